@@ -0,0 +1,564 @@
+#include <algorithm>
+#include <iostream>
+#include <koisyn.h>
+
+using namespace std;
+using namespace std::chrono;
+using namespace ks3;
+
+// A session over loopback with the channel it accepts. Every benchmark has a
+// server and a client in this process; the callbacks find the benchmark in
+// bench.
+class Endpoint
+{
+public:
+    Kontext ctx;
+    KoiSession sess;
+    void *bench = nullptr;
+
+    mutex chanMutex;
+    vector<KoiChan> channels;
+    vector<shared_ptr<int>> contexts;
+
+public:
+    Endpoint(void *bench) noexcept : bench{bench}
+    {
+        ctx.GlobalContext = this;
+        ctx.OnAccept      = &Endpoint::AutoAccept;
+    }
+
+    static bool AutoAccept(
+        KoiChan newChannel,
+        void *globalContext,
+        weak_ptr<void> &setChannelContext
+        ) noexcept
+    {
+        Endpoint &endpoint = *(Endpoint *)globalContext;
+        shared_ptr appContext = make_shared<int>();
+        setChannelContext = appContext;
+
+        lock_guard _{endpoint.chanMutex};
+        endpoint.channels.push_back(newChannel);
+        endpoint.contexts.push_back(appContext);
+
+        return true;
+    }
+
+    optional<KoiChan> GetChannel() noexcept
+    {
+        lock_guard _{chanMutex};
+        if (channels.empty()) { return nullopt; }
+        return channels.front();
+    }
+
+    template <typename T>
+    static T &GetBench(void *globalContext) noexcept
+    {
+        return *(T *)((Endpoint *)globalContext)->bench;
+    }
+};
+
+// Start both sessions, and connect the client to the server. Return the
+// channel of the client, or nullopt if it isn't up within a few seconds.
+optional<KoiChan> Connect(Endpoint &server, Endpoint &client)
+{
+    optional<uint16_t> serverPort = server.sess.Start(server.ctx);
+    if (not serverPort or not client.sess.Start(client.ctx))
+    {
+        cout << "can't start the sessions\n";
+        return nullopt;
+    }
+
+    client.sess.ConnectTo("127.0.0.1", *serverPort);
+    const auto deadline = steady_clock::now() + 10s;
+    while (steady_clock::now() < deadline)
+    {
+        optional chan = client.GetChannel();
+        if (chan and server.GetChannel())
+        {
+            // Let the handshake finish before we measure anything.
+            this_thread::sleep_for(1s);
+            return chan;
+        }
+        this_thread::sleep_for(10ms);
+    }
+    cout << "can't connect\n";
+    return nullopt;
+}
+
+void PrintLatencies(string_view name, vector<nanoseconds> samples)
+{
+    if (samples.empty())
+    {
+        cout << name << ": no pings returned\n";
+        return;
+    }
+
+    sort(samples.begin(), samples.end());
+    auto at = [&](double q)
+    {
+        nanoseconds sample = samples[(size_t)(q * (samples.size() - 1))];
+        return duration<double, micro>(sample).count();
+    };
+    cout << name << ": " << samples.size() << " pings, round trip p50 "
+        << at(0.5) << " us, p99 " << at(0.99) << " us, max " << at(1.0)
+        << " us\n";
+}
+
+// Channel 0 latency while channel 3 is saturated.
+//
+// The client pings the server on channel 0 every millisecond, and the
+// server echoes the pings; we report their round trips when idle, then while
+// the client sends bulk data on channel 3. Channel 0 has a higher priority
+// than channel 3 (see Kontext::StreamPriority), unless "equal" is passed.
+class Latency
+{
+public:
+    static constexpr milliseconds pingInterval = 1ms;
+    static constexpr seconds phaseDuration = 5s;
+    static constexpr size_t bulkSize = 16 * 1024;
+
+    // We keep this much in flight on channel 3, so that it always has data
+    // to send.
+    static constexpr uint64_t bulkInFlight = 4 * 1024 * 1024;
+
+    Endpoint server{this};
+    Endpoint client{this};
+
+    mutex sampleMutex;
+    vector<nanoseconds> samples;
+    atomic_uint64_t bulkReceived = 0;
+
+public:
+    static void OnEcho(
+        KoiChan channel,
+        span<const uint8_t> data,
+        [[maybe_unused]] void *globalContext,
+        [[maybe_unused]] void *channelContext
+        ) noexcept
+    {
+        channel.ReliablePacketSend(0, data);
+    }
+
+    static void OnBulk(
+        [[maybe_unused]] KoiChan channel,
+        span<const uint8_t> data,
+        void *globalContext,
+        [[maybe_unused]] void *channelContext
+        ) noexcept
+    {
+        Endpoint::GetBench<Latency>(globalContext).bulkReceived +=
+            data.size();
+    }
+
+    static void OnPong(
+        [[maybe_unused]] KoiChan channel,
+        span<const uint8_t> data,
+        void *globalContext,
+        [[maybe_unused]] void *channelContext
+        ) noexcept
+    {
+        if (data.size() != sizeof(int64_t)) { return; }
+        int64_t sent;
+        memcpy(&sent, data.data(), sizeof(sent));
+        const nanoseconds rtt =
+            steady_clock::now().time_since_epoch() - nanoseconds{sent};
+
+        Latency &bench = Endpoint::GetBench<Latency>(globalContext);
+        lock_guard _{bench.sampleMutex};
+        bench.samples.push_back(rtt);
+    }
+
+    int Run(bool prioritize)
+    {
+        if (prioritize)
+        {
+            for (Endpoint *endpoint : {&server, &client})
+            {
+                endpoint->ctx.StreamPriority[0] = HIGH_STREAM_PRIORITY;
+                endpoint->ctx.StreamPriority[3] = LOW_STREAM_PRIORITY;
+            }
+        }
+        server.ctx.OnReliableReceive[0] = &Latency::OnEcho;
+        server.ctx.OnReliableReceive[3] = &Latency::OnBulk;
+        client.ctx.OnReliableReceive[0] = &Latency::OnPong;
+
+        optional chan = Connect(server, client);
+        if (not chan) { return 1; }
+
+        cout << (prioritize ? "channel 0 prioritized\n" :
+            "equal priorities\n");
+        PrintLatencies("idle", Ping(*chan));
+
+        atomic_bool saturating = true;
+        thread bulk{[&]()
+        {
+            vector<uint8_t> data(bulkSize, 0x33);
+            while (saturating)
+            {
+                if (chan->GetSendingBytes() >= bulkInFlight)
+                {
+                    this_thread::sleep_for(100us);
+                    continue;
+                }
+                chan->ReliablePacketSend(3, data);
+            }
+        }};
+
+        // Let channel 3 fill the connection first.
+        this_thread::sleep_for(1s);
+        const uint64_t bulkBefore = bulkReceived;
+        const auto begin = steady_clock::now();
+        vector<nanoseconds> loaded = Ping(*chan);
+        const duration<double> elapsed = steady_clock::now() - begin;
+        saturating = false;
+        bulk.join();
+
+        PrintLatencies("channel 3 saturated", move(loaded));
+        cout << "channel 3 throughput: "
+            << (bulkReceived - bulkBefore) / elapsed.count() / 1e6
+            << " MB/s\n";
+
+        chan->Disconnect();
+        return 0;
+    }
+
+private:
+    vector<nanoseconds> Ping(KoiChan chan)
+    {
+        {
+            lock_guard _{sampleMutex};
+            samples.clear();
+        }
+
+        const auto begin = steady_clock::now();
+        for (int i = 0; steady_clock::now() < begin + phaseDuration; ++i)
+        {
+            this_thread::sleep_until(begin + i * pingInterval);
+            const int64_t now =
+                steady_clock::now().time_since_epoch().count();
+            uint8_t data[sizeof(now)];
+            memcpy(data, &now, sizeof(now));
+            chan.ReliablePacketSend(0, data);
+        }
+
+        // Wait for the last pongs.
+        this_thread::sleep_for(500ms);
+        lock_guard _{sampleMutex};
+        return exchange(samples, {});
+    }
+};
+
+// Several threads send on one KoiChan at once, as audio, gameplay and UI
+// threads of a game do.
+//
+// First every thread sends datagrams, paced so that loopback loses none. A
+// packet number taken by two threads makes the receiver drop the later
+// datagram as a copy, so every datagram sent must arrive. Then every thread
+// sends reliable messages on channel 1 as fast as it can; each must arrive
+// intact, and the messages of a thread in order. We report the throughput.
+class Stress
+{
+public:
+    static constexpr int threadCount = 4;
+    static constexpr uint32_t datagramsPerThread = 20'000;
+    static constexpr uint32_t messagesPerThread = 50'000;
+
+    // Datagrams a thread sends every millisecond.
+    static constexpr uint32_t datagramBurst = 16;
+
+    // We wait while this much is in flight on channel 1.
+    static constexpr uint64_t maxInFlight = 8 * 1024 * 1024;
+
+    Endpoint server{this};
+    Endpoint client{this};
+
+    mutex receiveMutex;
+    vector<bool> datagramSeen =
+        vector<bool>(threadCount * datagramsPerThread);
+    uint64_t datagramsReceived = 0;
+    uint64_t datagramsRepeated = 0;
+    array<uint32_t, threadCount> nextMessage{};
+    uint64_t messagesReceived = 0;
+    uint64_t messagesBroken = 0;
+
+public:
+    // [thread: 1] [index: 4] followed by index % 64 bytes derived from both.
+    static void MakeMessage(int thr, uint32_t index, vector<uint8_t> &out)
+    {
+        out.resize(5 + index % 64);
+        out[0] = (uint8_t)thr;
+        memcpy(&out[1], &index, sizeof(index));
+        for (size_t i = 5; i < out.size(); ++i)
+        {
+            out[i] = (uint8_t)(index + thr + i);
+        }
+    }
+
+    static void OnDatagram(
+        [[maybe_unused]] KoiChan channel,
+        span<const uint8_t> data,
+        void *globalContext,
+        [[maybe_unused]] void *channelContext
+        ) noexcept
+    {
+        Stress &bench = Endpoint::GetBench<Stress>(globalContext);
+        uint32_t index;
+        if (data.size() != 1 + sizeof(index)) { return; }
+        memcpy(&index, &data[1], sizeof(index));
+        if (data[0] >= threadCount or index >= datagramsPerThread) { return; }
+
+        lock_guard _{bench.receiveMutex};
+        const size_t slot = data[0] * datagramsPerThread + index;
+        if (bench.datagramSeen[slot])
+        {
+            ++bench.datagramsRepeated;
+            return;
+        }
+        bench.datagramSeen[slot] = true;
+        ++bench.datagramsReceived;
+    }
+
+    static void OnMessage(
+        [[maybe_unused]] KoiChan channel,
+        span<const uint8_t> data,
+        void *globalContext,
+        [[maybe_unused]] void *channelContext
+        ) noexcept
+    {
+        Stress &bench = Endpoint::GetBench<Stress>(globalContext);
+        lock_guard _{bench.receiveMutex};
+        ++bench.messagesReceived;
+
+        if (data.empty() or data[0] >= threadCount)
+        {
+            ++bench.messagesBroken;
+            return;
+        }
+        const int thr = data[0];
+        vector<uint8_t> expected;
+        MakeMessage(thr, bench.nextMessage[thr]++, expected);
+        if (not ranges::equal(data, expected)) { ++bench.messagesBroken; }
+    }
+
+    int Run()
+    {
+        server.ctx.OnUnreliableReceive = &Stress::OnDatagram;
+        server.ctx.OnLateUnreliableReceive = &Stress::OnDatagram;
+        server.ctx.OnReliableReceive[1] = &Stress::OnMessage;
+
+        optional chan = Connect(server, client);
+        if (not chan) { return 1; }
+
+        const bool datagramsOk = SendDatagrams(*chan);
+        const bool messagesOk = SendMessages(*chan);
+
+        chan->Disconnect();
+        return datagramsOk and messagesOk ? 0 : 1;
+    }
+
+private:
+    bool SendDatagrams(KoiChan chan)
+    {
+        atomic_uint64_t sent = 0;
+        const auto begin = steady_clock::now();
+        RunThreads([&](int thr)
+        {
+            for (uint32_t i = 0; i < datagramsPerThread; ++i)
+            {
+                if (i % datagramBurst == 0)
+                {
+                    this_thread::sleep_until(
+                        begin + i / datagramBurst * 1ms);
+                }
+                uint8_t data[1 + sizeof(i)] {(uint8_t)thr};
+                memcpy(&data[1], &i, sizeof(i));
+                sent += chan.UnreliablePacketSend(data);
+            }
+        });
+        const duration<double> elapsed = steady_clock::now() - begin;
+
+        WaitFor([&] { return datagramsReceived >= sent; }, 2s);
+        lock_guard _{receiveMutex};
+        cout << "datagrams: " << sent << " sent by " << threadCount
+            << " threads in " << elapsed.count() << " s, "
+            << datagramsReceived << " received, " << datagramsRepeated
+            << " repeated\n";
+        return datagramsReceived == sent and datagramsRepeated == 0;
+    }
+
+    bool SendMessages(KoiChan chan)
+    {
+        atomic_uint64_t failed = 0;
+        const auto begin = steady_clock::now();
+        RunThreads([&](int thr)
+        {
+            vector<uint8_t> data;
+            for (uint32_t i = 0; i < messagesPerThread; ++i)
+            {
+                while (chan.GetSendingBytes(1) >= maxInFlight)
+                {
+                    this_thread::sleep_for(100us);
+                }
+                MakeMessage(thr, i, data);
+                failed += not chan.ReliablePacketSend(1, data);
+            }
+        });
+
+        const uint64_t total = threadCount * messagesPerThread;
+        WaitFor([&] { return messagesReceived >= total; }, 30s);
+        const duration<double> elapsed = steady_clock::now() - begin;
+
+        lock_guard _{receiveMutex};
+        cout << "reliable: " << messagesReceived << " of " << total
+            << " messages from " << threadCount << " threads in "
+            << elapsed.count() << " s, " << messagesReceived /
+            elapsed.count() << " messages/s, " << messagesBroken
+            << " broken, " << failed << " failed to send\n";
+        return messagesReceived == total and messagesBroken == 0 and
+            failed == 0;
+    }
+
+    template <typename Work>
+    static void RunThreads(Work &&work)
+    {
+        vector<thread> threads;
+        for (int thr = 0; thr < threadCount; ++thr)
+        {
+            threads.emplace_back(work, thr);
+        }
+        for (thread &thr : threads) { thr.join(); }
+    }
+
+    template <typename Done>
+    void WaitFor(Done &&done, seconds timeout)
+    {
+        const auto deadline = steady_clock::now() + timeout;
+        while (steady_clock::now() < deadline)
+        {
+            {
+                lock_guard _{receiveMutex};
+                if (done()) { return; }
+            }
+            this_thread::sleep_for(10ms);
+        }
+    }
+};
+
+// Many tiny reliable messages, so that every receive event holds a lot of
+// them and the parser delivers most in place (see FrameParser).
+//
+// The client batches messagesPerFrame messages of 4 to 8 bytes at a time
+// with BeginFrame() and Flush(), and the server checks that they arrive in
+// order. We report the messages received per second.
+class Tiny
+{
+public:
+    static constexpr uint32_t messageCount = 4'000'000;
+    static constexpr uint32_t messagesPerFrame = 256;
+    static constexpr uint64_t maxInFlight = 4 * 1024 * 1024;
+
+    Endpoint server{this};
+    Endpoint client{this};
+
+    // The receive callbacks of a channel are called one at a time.
+    atomic_uint32_t received = 0;
+    atomic_uint32_t broken = 0;
+
+public:
+    // [index: 4] followed by index % 5 bytes of index.
+    static span<const uint8_t> MakeMessage(uint32_t index, uint8_t *out)
+    {
+        memcpy(out, &index, sizeof(index));
+        const size_t extra = index % 5;
+        memset(out + sizeof(index), (uint8_t)index, extra);
+        return {out, sizeof(index) + extra};
+    }
+
+    static void OnMessage(
+        [[maybe_unused]] KoiChan channel,
+        span<const uint8_t> data,
+        void *globalContext,
+        [[maybe_unused]] void *channelContext
+        ) noexcept
+    {
+        Tiny &bench = Endpoint::GetBench<Tiny>(globalContext);
+        uint8_t expected[8];
+        if (not ranges::equal(data, MakeMessage(bench.received, expected)))
+        {
+            ++bench.broken;
+        }
+        ++bench.received;
+    }
+
+    int Run()
+    {
+        server.ctx.OnReliableReceive[2] = &Tiny::OnMessage;
+
+        optional chan = Connect(server, client);
+        if (not chan) { return 1; }
+
+        uint32_t failed = 0;
+        const auto begin = steady_clock::now();
+        for (uint32_t i = 0; i < messageCount; i += messagesPerFrame)
+        {
+            while (chan->GetSendingBytes(2) >= maxInFlight)
+            {
+                this_thread::sleep_for(100us);
+            }
+
+            chan->BeginFrame();
+            const uint32_t end = min(i + messagesPerFrame, messageCount);
+            for (uint32_t index = i; index < end; ++index)
+            {
+                uint8_t data[8];
+                failed += not chan->ReliablePacketSend(
+                    2, MakeMessage(index, data));
+            }
+            failed += not chan->Flush();
+        }
+
+        const auto deadline = steady_clock::now() + 30s;
+        while (received < messageCount and steady_clock::now() < deadline)
+        {
+            this_thread::sleep_for(1ms);
+        }
+        const duration<double> elapsed = steady_clock::now() - begin;
+
+        cout << "tiny messages: " << received << " of " << messageCount
+            << " in " << elapsed.count() << " s, " << received /
+            elapsed.count() / 1e6 << " M messages/s, " << broken
+            << " broken, " << failed << " failed to send\n";
+
+        chan->Disconnect();
+        return received == messageCount and broken == 0 and failed == 0 ?
+            0 : 1;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const string_view benchmark = argc > 1 ? argv[1] : "";
+    const string_view option = argc > 2 ? argv[2] : "";
+
+    if (benchmark == "latency")
+    {
+        return Latency{}.Run(option != "equal");
+    }
+    if (benchmark == "stress")
+    {
+        return Stress{}.Run();
+    }
+    if (benchmark == "tiny")
+    {
+        return Tiny{}.Run();
+    }
+
+    cout << R"(Usage:
+    Benchmark latency [equal]    channel 0 latency while channel 3 is
+                                 saturated; "equal" doesn't prioritize it.
+    Benchmark stress             send from several threads on one channel.
+    Benchmark tiny               many tiny reliable messages per receive.
+)";
+    return 1;
+}
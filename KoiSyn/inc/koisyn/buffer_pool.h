@@ -0,0 +1,271 @@
+#pragma once
+
+#include "std/std_precomp.h"
+#include "ring_queue.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+struct BufferPoolStats
+{
+    uint32_t BlockSize = 0;
+    uint32_t Capacity = 0;  // blocks preallocated
+    uint32_t InUse = 0;
+    uint32_t PeakInUse = 0;
+    uint64_t Fallbacks = 0; // allocated from the heap since the pool was empty
+};
+
+// Size-classed pools of memory blocks, for the buffers we pass to msquic.
+// They are allocated on the thread that sends and freed on a msquic worker
+// thread when the send completes, so every class keeps its free blocks in a
+// lock-free stack that any thread can push to and pop from.
+//
+// The blocks of a class are preallocated in one slab and linked by index.
+// The top of the stack is the index with a tag counting the updates, so that
+// a stale compare-and-swap (ABA) fails. A request larger than every class,
+// or one that finds its class empty, falls back to the heap.
+//
+// A pool made with threadCache also keeps a few free blocks of every class
+// per thread, in a magazine in front of the stacks, so a thread that frees
+// and allocates again mostly skips them. A thread returns its magazine when
+// it exits, so such a pool must outlive every thread, like the send buffer
+// pool. A thread keeps a magazine for the first such pool it uses only.
+class BufferPool
+{
+public:
+    static constexpr int NUM_CLASSES = 4;
+
+    // The largest class holds the largest reliable message with its header.
+    static constexpr array<uint32_t, NUM_CLASSES> BLOCK_SIZES
+    {
+        256, 2048, 16384, 66 * 1024,
+    };
+    static constexpr array<uint32_t, NUM_CLASSES> BLOCK_COUNTS
+    {
+        512, 512, 32, 8,
+    };
+
+    // Free blocks a thread keeps per class. A full magazine returns its
+    // older half to the stack at once.
+    static constexpr uint32_t MAGAZINE_SIZE = 16;
+
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct alignas(CACHE_LINE_SIZE) SizeClass
+    {
+        atomic_uint64_t Top{NIL}; // index | tag << 32
+        atomic_uint32_t InUse{0};
+        atomic_uint32_t PeakInUse{0};
+        atomic_uint64_t Fallbacks{0};
+        unique_ptr<uint8_t[]> Slab;
+        unique_ptr<atomic_uint32_t[]> Next;
+        uint32_t Capacity = 0;
+    };
+
+    array<SizeClass, NUM_CLASSES> classes;
+    bool threadCache = false;
+
+    struct Magazine
+    {
+        BufferPool *Pool = nullptr;
+        array<uint32_t, NUM_CLASSES> Counts{};
+        array<array<uint32_t, MAGAZINE_SIZE>, NUM_CLASSES> Blocks;
+
+        ~Magazine()
+        {
+            if (Pool == nullptr) { return; }
+            for (int i = 0; i < NUM_CLASSES; ++i)
+            {
+                PushChain(Pool->classes[i], span{Blocks[i].data(), Counts[i]});
+            }
+        }
+    };
+
+public:
+    // A class whose slab can't be allocated always falls back to the heap.
+    explicit BufferPool(bool threadCache = false) noexcept :
+        threadCache{threadCache}
+    {
+        for (int i = 0; i < NUM_CLASSES; ++i)
+        {
+            SizeClass &c = classes[i];
+            const uint32_t count = BLOCK_COUNTS[i];
+            c.Slab.reset(new(nothrow) uint8_t[(size_t)BLOCK_SIZES[i] * count]);
+            c.Next.reset(new(nothrow) atomic_uint32_t[count]);
+            if (not c.Slab or not c.Next) [[unlikely]]
+            {
+                c.Slab.reset();
+                c.Next.reset();
+                continue;
+            }
+            for (uint32_t b = 0; b < count; ++b)
+            {
+                c.Next[b].store(b + 1 == count ? NIL : b + 1,
+                    memory_order_relaxed);
+            }
+            c.Capacity = count;
+            c.Top.store(0, memory_order_release);
+        }
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    void operator=(const BufferPool &) = delete;
+
+    // Thread safe. Return nullptr if we are out of memory.
+    [[nodiscard]] void *Allocate(size_t size) noexcept
+    {
+        const int i = GetClass(size);
+        if (i == NUM_CLASSES)
+        {
+            return new(nothrow) uint8_t[size];
+        }
+
+        SizeClass &c = classes[i];
+        Magazine *magazine = GetMagazine();
+        const uint32_t index = magazine != nullptr and
+            magazine->Counts[i] != 0 ?
+            magazine->Blocks[i][--magazine->Counts[i]] : Pop(c);
+        if (index == NIL)
+        {
+            ++c.Fallbacks;
+            return new(nothrow) uint8_t[size];
+        }
+
+        const uint32_t inUse = ++c.InUse;
+        uint32_t peak = c.PeakInUse.load(memory_order_relaxed);
+        while (peak < inUse and not c.PeakInUse.compare_exchange_weak(
+            peak, inUse, memory_order_relaxed)) {}
+        return &c.Slab[(size_t)index * BLOCK_SIZES[i]];
+    }
+
+    // Thread safe. Accept anything returned by Allocate().
+    void Free(void *block) noexcept
+    {
+        uint8_t *p = (uint8_t *)block;
+        for (int i = 0; i < NUM_CLASSES; ++i)
+        {
+            SizeClass &c = classes[i];
+            if (c.Capacity == 0) { continue; }
+            const uint8_t *begin = c.Slab.get();
+            const uint8_t *end = begin + (size_t)BLOCK_SIZES[i] * c.Capacity;
+            if (p < begin or p >= end) { continue; }
+
+            const uint32_t index = (uint32_t)((p - begin) / BLOCK_SIZES[i]);
+            --c.InUse;
+            Magazine *magazine = GetMagazine();
+            if (magazine == nullptr)
+            {
+                Push(c, index);
+                return;
+            }
+
+            array<uint32_t, MAGAZINE_SIZE> &blocks = magazine->Blocks[i];
+            uint32_t &count = magazine->Counts[i];
+            if (count == MAGAZINE_SIZE)
+            {
+                constexpr uint32_t half = MAGAZINE_SIZE / 2;
+                PushChain(c, span{blocks.data(), half});
+                copy(blocks.begin() + half, blocks.end(), blocks.begin());
+                count -= half;
+            }
+            blocks[count++] = index;
+            return;
+        }
+        delete[] p;
+    }
+
+    [[nodiscard]] BufferPoolStats GetStats(int sizeClass) const noexcept
+    {
+        if (sizeClass < 0 or sizeClass >= NUM_CLASSES) [[unlikely]]
+        {
+            return {};
+        }
+        const SizeClass &c = classes[sizeClass];
+        return {
+            .BlockSize = BLOCK_SIZES[sizeClass],
+            .Capacity = c.Capacity,
+            .InUse = c.InUse.load(memory_order_relaxed),
+            .PeakInUse = c.PeakInUse.load(memory_order_relaxed),
+            .Fallbacks = c.Fallbacks.load(memory_order_relaxed),
+        };
+    }
+
+private:
+    [[nodiscard]] Magazine *GetMagazine() noexcept
+    {
+        if (not threadCache) { return nullptr; }
+        thread_local Magazine magazine;
+        if (magazine.Pool == nullptr) { magazine.Pool = this; }
+        return magazine.Pool == this ? &magazine : nullptr;
+    }
+
+    [[nodiscard]] static int GetClass(size_t size) noexcept
+    {
+        int i = 0;
+        while (i < NUM_CLASSES and size > BLOCK_SIZES[i]) { ++i; }
+        return i;
+    }
+
+    [[nodiscard]] static uint32_t Pop(SizeClass &c) noexcept
+    {
+        uint64_t top = c.Top.load(memory_order_acquire);
+        while (true)
+        {
+            const uint32_t index = (uint32_t)top;
+            if (index == NIL) { return NIL; }
+
+            // If another thread pops it first, the tag has changed and the
+            // exchange fails, so a stale next is never installed.
+            const uint64_t tag = (top >> 32) + 1;
+            const uint32_t next = c.Next[index].load(memory_order_relaxed);
+            if (c.Top.compare_exchange_weak(top, tag << 32 | next,
+                memory_order_acquire, memory_order_acquire))
+            {
+                return index;
+            }
+        }
+    }
+
+    static void Push(SizeClass &c, uint32_t index) noexcept
+    {
+        PushChain(c, span{&index, 1});
+    }
+
+    // Push the blocks with one compare-and-swap, the first on top.
+    static void PushChain(SizeClass &c, span<const uint32_t> blocks) noexcept
+    {
+        if (blocks.empty()) { return; }
+        for (size_t b = 0; b + 1 < blocks.size(); ++b)
+        {
+            c.Next[blocks[b]].store(blocks[b + 1], memory_order_relaxed);
+        }
+
+        uint64_t top = c.Top.load(memory_order_relaxed);
+        while (true)
+        {
+            c.Next[blocks.back()].store((uint32_t)top, memory_order_relaxed);
+            const uint64_t tag = (top >> 32) + 1;
+            if (c.Top.compare_exchange_weak(top, tag << 32 | blocks.front(),
+                memory_order_release, memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+};
+
+// The pool of the buffers sent by every KoiChan, with per-thread magazines.
+// It is never destroyed: msquic may complete a send, which frees its
+// buffer, after the static objects are destroyed, and a thread may return
+// its magazine as late.
+inline BufferPool &GetSendBufferPool() noexcept
+{
+    alignas(BufferPool) static uint8_t storage[sizeof(BufferPool)];
+    static BufferPool &pool = *new(storage) BufferPool{true};
+    return pool;
+}
+
+} // namespace ks3::detail
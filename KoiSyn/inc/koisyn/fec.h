@@ -0,0 +1,239 @@
+#pragma once
+
+#include "std/std_precomp.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// Forward error correction for datagrams with XOR parity. After every group
+// of N datagrams, the sender sends a parity datagram: the XOR of their
+// payloads (zero padded to the longest) and of their lengths. A receiver
+// missing exactly one datagram of the group XORs the parity with the others
+// to rebuild it, without waiting a round trip for anything.
+//
+// On wire, the 4-byte packet number of a datagram has the highest bit set
+// for a parity datagram, whose number is the first one of its group:
+// [members: 4, BE] [lengths XORed: 2, BE] [payloads XORed]
+// Bit i of the members is set if the packet first + i is in the group. The
+// numbers are taken by several threads, so they may be added out of order
+// or not at all.
+// The next bit marks a fragment (see fragment.h), so packet numbers are 30
+// bits.
+inline constexpr uint32_t PARITY_FLAG = 0x8000'0000;
+inline constexpr uint32_t FRAGMENT_FLAG = 0x4000'0000;
+inline constexpr uint32_t PACKET_NUMBER_MASK = 0x3fff'ffff;
+
+// If the packet number is `expected` or after it, with wrapping.
+[[nodiscard]] constexpr bool IsAtOrAfter(uint32_t number, uint32_t expected)
+    noexcept
+{
+    return ((number - expected) & PACKET_NUMBER_MASK) < 0x2000'0000;
+}
+
+// Pass it as the group size to follow the loss (see ParityEncoder).
+inline constexpr int ADAPTIVE_FEC = -1;
+
+class ParityEncoder
+{
+public:
+    static constexpr int MAX_GROUP_SIZE = 32;
+    static constexpr size_t HEADER_SIZE = 6;
+
+    // Datagrams longer than this are not covered.
+    static constexpr size_t MAX_PAYLOAD = 1200;
+
+    enum class AddResult : uint8_t
+    {
+        Pending,  // nothing to send yet
+        Complete, // added, and the group is complete
+        Closed,   // the group is closed before it; add it again after
+    };
+
+private:
+    array<uint8_t, MAX_PAYLOAD> parity{};
+    size_t maxLength = 0;
+    uint16_t lengths = 0;
+    uint32_t first = 0;
+    uint32_t members = 0;
+    int count = 0;
+    atomic_int groupSize = 0; // 0 if off
+
+public:
+    // 0 turns it off; ADAPTIVE_FEC follows the loss passed to Add(). Any
+    // thread may call it; the group open goes on with the new size.
+    void SetGroupSize(int size) noexcept
+    {
+        groupSize = size == ADAPTIVE_FEC ?
+            ADAPTIVE_FEC : clamp(size, 0, MAX_GROUP_SIZE);
+    }
+
+    [[nodiscard]] int GetGroupSize() const noexcept { return groupSize; }
+
+    // We lose a group when two of its datagrams are lost, so we keep the
+    // expected loss of a group, N * loss, around 1/8. Below 0.5% loss we
+    // send no parity.
+    [[nodiscard]] static int GetAdaptiveGroupSize(double loss) noexcept
+    {
+        if (loss < 0.005) { return 0; }
+        return clamp((int)(0.125 / loss), 2, MAX_GROUP_SIZE);
+    }
+
+    void Reset() noexcept
+    {
+        memset(parity.data(), 0, maxLength);
+        members = 0;
+        count = 0;
+        maxLength = 0;
+        lengths = 0;
+    }
+
+    // Add a datagram being sent, made of the parts. Unless it returns
+    // Pending, TakeParity() should be sent now. A datagram out of the range
+    // of the members closes the group before it, and starts the next one
+    // when added again. A datagram longer than maxPayload, with which the
+    // parity wouldn't fit a datagram, closes the group too, but is never
+    // covered. Call it on one thread at a time.
+    [[nodiscard]] AddResult Add(
+        uint32_t number,
+        span<const span<const uint8_t>> parts,
+        double loss,
+        size_t maxPayload
+        ) noexcept
+    {
+        const int setting = groupSize;
+        const int size = setting == ADAPTIVE_FEC ?
+            GetAdaptiveGroupSize(loss) : setting;
+        if (size < 2)
+        {
+            Reset();
+            return AddResult::Pending;
+        }
+
+        size_t length = 0;
+        for (span<const uint8_t> part : parts) { length += part.size(); }
+        if (length > min(MAX_PAYLOAD, maxPayload))
+        {
+            return count != 0 ? AddResult::Closed : AddResult::Pending;
+        }
+
+        if (count == 0) { first = number; }
+        const uint32_t member = (number - first) & PACKET_NUMBER_MASK;
+        if (member >= MAX_GROUP_SIZE) { return AddResult::Closed; }
+        members |= 1u << member;
+
+        size_t offset = 0;
+        for (span<const uint8_t> part : parts)
+        {
+            for (uint8_t byte : part) { parity[offset++] ^= byte; }
+        }
+        maxLength = max(maxLength, length);
+        lengths ^= (uint16_t)length;
+        return ++count >= size ? AddResult::Complete : AddResult::Pending;
+    }
+
+    // Write the parity of the group to out (of MAX_PAYLOAD + HEADER_SIZE),
+    // and start a new group. Return the size written, and the first packet
+    // number of the group to send it with.
+    [[nodiscard]] size_t TakeParity(span<uint8_t> out, uint32_t &number)
+        noexcept
+    {
+        if (count == 0 or out.size() < HEADER_SIZE + maxLength) { return 0; }
+        out[0] = (uint8_t)(members >> 24);
+        out[1] = (uint8_t)(members >> 16);
+        out[2] = (uint8_t)(members >> 8);
+        out[3] = (uint8_t)members;
+        out[4] = (uint8_t)(lengths >> 8);
+        out[5] = (uint8_t)lengths;
+        memcpy(&out[HEADER_SIZE], parity.data(), maxLength);
+
+        number = first;
+        const size_t size = HEADER_SIZE + maxLength;
+        Reset();
+        return size;
+    }
+};
+
+// Remember the recent datagrams received, and rebuild a missing one from
+// the parity of its group.
+class ParityDecoder
+{
+public:
+    static constexpr int HISTORY = 64;
+    static constexpr size_t MAX_PAYLOAD = ParityEncoder::MAX_PAYLOAD;
+
+private:
+    struct Packet
+    {
+        uint32_t Number = UINT32_MAX; // never a packet number (30 bits)
+        uint16_t Size = 0;
+        array<uint8_t, MAX_PAYLOAD> Data;
+    };
+
+    array<Packet, HISTORY> packets;
+
+public:
+    void OnData(uint32_t number, span<const uint8_t> data) noexcept
+    {
+        if (data.size() > MAX_PAYLOAD) { return; }
+        Packet &packet = packets[number % HISTORY];
+        packet.Number = number;
+        packet.Size = (uint16_t)data.size();
+        memcpy(packet.Data.data(), data.data(), data.size());
+    }
+
+    // Rebuild the datagram into out (of MAX_PAYLOAD) if it is the only one
+    // of the group missing. Return the size, or nullopt if none is rebuilt.
+    [[nodiscard]] optional<size_t> OnParity(
+        uint32_t first,
+        span<const uint8_t> parity,
+        span<uint8_t> out,
+        uint32_t &number
+        ) noexcept
+    {
+        if (parity.size() < ParityEncoder::HEADER_SIZE) { return nullopt; }
+        const uint32_t members = (uint32_t)parity[0] << 24 |
+            (uint32_t)parity[1] << 16 | (uint32_t)parity[2] << 8 | parity[3];
+        uint16_t length = (uint16_t)(parity[4] << 8 | parity[5]);
+        span<const uint8_t> payload =
+            parity.subspan(ParityEncoder::HEADER_SIZE);
+        if (payload.size() > MAX_PAYLOAD or out.size() < payload.size())
+        {
+            return nullopt;
+        }
+
+        optional<uint32_t> missing;
+        for (int i = 0; i < ParityEncoder::MAX_GROUP_SIZE; ++i)
+        {
+            if ((members >> i & 1) == 0) { continue; }
+            const uint32_t n = (first + i) & PACKET_NUMBER_MASK;
+            if (packets[n % HISTORY].Number == n) { continue; }
+            if (missing) { return nullopt; } // two are lost
+            missing = n;
+        }
+        if (not missing) { return nullopt; }
+
+        memcpy(out.data(), payload.data(), payload.size());
+        for (int i = 0; i < ParityEncoder::MAX_GROUP_SIZE; ++i)
+        {
+            if ((members >> i & 1) == 0) { continue; }
+            const uint32_t n = (first + i) & PACKET_NUMBER_MASK;
+            if (n == *missing) { continue; }
+            const Packet &packet = packets[n % HISTORY];
+            length ^= packet.Size;
+            for (size_t b = 0; b < min<size_t>(packet.Size, payload.size());
+                ++b)
+            {
+                out[b] ^= packet.Data[b];
+            }
+        }
+        if (length > payload.size()) { return nullopt; }
+
+        number = *missing;
+        OnData(number, span{out.data(), length});
+        return length;
+    }
+};
+
+} // namespace ks3::detail
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "std/std_precomp.h"
+#include "fec.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+using namespace std::chrono;
+
+// A datagram message longer than a datagram is split into fragments of the
+// same size but the last one. The 4-byte packet number of a fragment has
+// FRAGMENT_FLAG set, and holds the message id and its index and count:
+// [flags: 2 bits] [message id: 16] [index: 7] [count: 7]
+// followed by the size of the fragments (2 bytes, BE) and the data. It has
+// no packet number of its own, so it is not ordered with other datagrams
+// nor covered by the parity.
+struct FragmentHeader
+{
+    static constexpr int MAX_FRAGMENTS = 127;
+    static constexpr size_t SIZE = 6;
+
+    uint16_t MessageId;
+    uint8_t Index;
+    uint8_t Count;
+    uint16_t FragmentSize; // of every fragment but the last one
+
+    [[nodiscard]] uint32_t Encode() const noexcept
+    {
+        return FRAGMENT_FLAG | (uint32_t)MessageId << 14 |
+            (uint32_t)Index << 7 | Count;
+    }
+
+    [[nodiscard]] static FragmentHeader Decode(
+        uint32_t number,
+        uint16_t fragmentSize
+        ) noexcept
+    {
+        return {
+            .MessageId = (uint16_t)(number >> 14),
+            .Index = (uint8_t)(number >> 7 & 0x7f),
+            .Count = (uint8_t)(number & 0x7f),
+            .FragmentSize = fragmentSize,
+        };
+    }
+};
+
+// Reassemble the fragments received into messages. A few messages may be
+// incomplete at a time; one still incomplete past DEADLINE is dropped, and
+// so is the oldest one when another starts and there is no room.
+class FragmentAssembler
+{
+public:
+    static constexpr int MAX_MESSAGES = 8;
+    static constexpr milliseconds DEADLINE = 500ms;
+
+    // We remember the ids of the messages completed lately, so that the
+    // fragments sent on both connections don't deliver them twice.
+    static constexpr int COMPLETED_IDS = 16;
+
+private:
+    struct Message
+    {
+        unique_ptr<uint8_t[]> Data;
+        steady_clock::time_point Started;
+        bitset<FragmentHeader::MAX_FRAGMENTS> Received;
+        size_t Length = 0;
+        uint16_t MessageId = 0;
+        uint16_t FragmentSize = 0;
+        uint8_t Count = 0; // 0 if unused
+    };
+
+    array<Message, MAX_MESSAGES> messages;
+    array<int32_t, COMPLETED_IDS> completed;
+    int nextCompleted = 0;
+
+public:
+    FragmentAssembler() noexcept { Reset(); }
+
+    void Reset() noexcept
+    {
+        for (Message &message : messages) { Free(message); }
+        completed.fill(-1);
+        nextCompleted = 0;
+    }
+
+    // Return the whole message when the fragment completes it. It is valid
+    // until the next call.
+    [[nodiscard]] optional<span<const uint8_t>> OnFragment(
+        const FragmentHeader &header,
+        span<const uint8_t> data,
+        steady_clock::time_point now
+        ) noexcept
+    {
+        const bool last = header.Index + 1 == header.Count;
+        if (header.Count == 0 or header.Index >= header.Count or
+            header.FragmentSize == 0 or
+            data.size() > header.FragmentSize or
+            (not last and data.size() != header.FragmentSize)) [[unlikely]]
+        {
+            return nullopt;
+        }
+        if (ranges::find(completed, header.MessageId) != completed.end())
+        {
+            return nullopt;
+        }
+
+        Expire(now);
+        Message *message = Find(header, now);
+        if (message == nullptr) { return nullopt; }
+
+        if (message->Received[header.Index]) { return nullopt; }
+        message->Received[header.Index] = true;
+        memcpy(&message->Data[(size_t)header.Index * header.FragmentSize],
+            data.data(), data.size());
+        message->Length += data.size();
+        if ((int)message->Received.count() != message->Count)
+        {
+            return nullopt;
+        }
+
+        completed[nextCompleted] = message->MessageId;
+        nextCompleted = (nextCompleted + 1) % COMPLETED_IDS;
+        span<const uint8_t> whole{message->Data.get(), message->Length};
+        message->Count = 0; // freed on the next call
+        return whole;
+    }
+
+private:
+    static void Free(Message &message) noexcept
+    {
+        message.Data.reset();
+        message.Received.reset();
+        message.Length = 0;
+        message.Count = 0;
+    }
+
+    void Expire(steady_clock::time_point now) noexcept
+    {
+        for (Message &message : messages)
+        {
+            if (message.Count == 0 or now - message.Started > DEADLINE)
+            {
+                Free(message);
+            }
+        }
+    }
+
+    // The message of the fragment, started if it is new. Return nullptr if
+    // the fragment doesn't match it, or we are out of memory.
+    [[nodiscard]] Message *Find(
+        const FragmentHeader &header,
+        steady_clock::time_point now
+        ) noexcept
+    {
+        Message *oldest = &messages[0];
+        for (Message &message : messages)
+        {
+            if (message.Data and message.MessageId == header.MessageId)
+            {
+                const bool same = message.Count == header.Count and
+                    message.FragmentSize == header.FragmentSize;
+                return same ? &message : nullptr;
+            }
+            if (not message.Data) { oldest = &message; }
+            else if (oldest->Data and message.Started < oldest->Started)
+            {
+                oldest = &message;
+            }
+        }
+
+        Message &message = *oldest;
+        Free(message);
+        const size_t capacity = (size_t)header.Count * header.FragmentSize;
+        message.Data.reset(new(nothrow) uint8_t[capacity]);
+        if (not message.Data) [[unlikely]] { return nullptr; }
+        message.Started = now;
+        message.MessageId = header.MessageId;
+        message.FragmentSize = header.FragmentSize;
+        message.Count = header.Count;
+        return &message;
+    }
+};
+
+} // namespace ks3::detail
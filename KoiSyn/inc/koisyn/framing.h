@@ -0,0 +1,142 @@
+#pragma once
+
+#include "std/std_precomp.h"
+#include "varint.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// Split the bytes of a reliable stream into messages, each prefixed with its
+// length as a varint. A message within the bytes passed at once is
+// delivered in place; only one split between them is copied, into a buffer
+// that holds just that message. The buffer is reserved up front up to
+// KEPT_CAPACITY, and grows with the bytes that arrive beyond, so a prefix
+// alone can't make us allocate the 4 GiB a message may take.
+class FrameParser
+{
+public:
+    static constexpr uint64_t MAX_MESSAGE_SIZE = UINT32_MAX;
+    static constexpr size_t MAX_PREFIX_SIZE = GetVarintSize(MAX_MESSAGE_SIZE);
+
+    // We keep the memory of a split message up to this size for the next.
+    static constexpr size_t KEPT_CAPACITY = 64 * 1024;
+
+private:
+    vector<uint8_t> partial; // the prefix, then the body
+    size_t prefixSize = 0;   // 0 until the prefix is complete
+    uint64_t messageSize = 0;
+
+public:
+    FrameParser() noexcept
+    {
+        partial.reserve(1500);
+    }
+
+    void Reset() noexcept
+    {
+        if (partial.capacity() > KEPT_CAPACITY) { partial = {}; }
+        partial.clear();
+        prefixSize = 0;
+        messageSize = 0;
+    }
+
+    // Call onMessage(span<const uint8_t>) for every message the bytes
+    // complete. The span is valid during the call. Return false if a
+    // message is too long or can't be buffered; the stream is unusable then.
+    template <typename OnMessage>
+    [[nodiscard]] bool Parse(span<const uint8_t> bytes, OnMessage &&onMessage)
+        noexcept
+    try
+    {
+        while (not bytes.empty())
+        {
+            if (partial.empty())
+            {
+                uint64_t size;
+                const size_t prefix = DecodeVarint(bytes, size);
+                if (prefix > MAX_PREFIX_SIZE or size > MAX_MESSAGE_SIZE)
+                {
+                    return false;
+                }
+                if (prefix != 0 and bytes.size() - prefix >= size)
+                {
+                    onMessage(bytes.subspan(prefix, (size_t)size));
+                    bytes = bytes.subspan(prefix + (size_t)size);
+                    continue;
+                }
+            }
+
+            optional rest = Buffer(bytes);
+            if (not rest) { return false; }
+            bytes = *rest;
+            if (prefixSize == 0) { continue; }
+
+            if (partial.size() == prefixSize + messageSize)
+            {
+                onMessage(span<const uint8_t>{
+                    partial.data() + prefixSize, (size_t)messageSize});
+                Reset();
+            }
+        }
+        return true;
+    }
+    catch (const exception &)
+    {
+        return false;
+    }
+
+    // During onMessage, whether the message is the split one, held in the
+    // buffer rather than in the bytes passed.
+    [[nodiscard]] bool IsBuffered(span<const uint8_t> message) const noexcept
+    {
+        return not partial.empty() and
+            message.data() == partial.data() + prefixSize;
+    }
+
+    // During onMessage for the split message, take the buffer that holds it,
+    // so that the message outlives the call where it is.
+    [[nodiscard]] vector<uint8_t> TakeBuffer() noexcept
+    {
+        return exchange(partial, {});
+    }
+
+private:
+    // Copy the bytes of the split message, at most up to its end. Return
+    // the rest, or nullopt if the message is too long.
+    optional<span<const uint8_t>> Buffer(span<const uint8_t> bytes)
+    {
+        if (prefixSize == 0)
+        {
+            // The prefix ends at the first byte without the high bit.
+            size_t count = 0;
+            bool ended = false;
+            while (not ended and count < bytes.size() and
+                partial.size() + count < MAX_PREFIX_SIZE)
+            {
+                ended = (bytes[count++] & 0x80) == 0;
+            }
+            partial.insert(partial.end(), bytes.begin(), bytes.begin() + count);
+            bytes = bytes.subspan(count);
+            if (not ended)
+            {
+                if (partial.size() == MAX_PREFIX_SIZE) { return nullopt; }
+                return bytes;
+            }
+
+            prefixSize = DecodeVarint(partial, messageSize);
+            if (messageSize > MAX_MESSAGE_SIZE) { return nullopt; }
+            partial.reserve(min(
+                prefixSize + (size_t)messageSize, KEPT_CAPACITY));
+        }
+
+        const size_t missing =
+            (size_t)(prefixSize + messageSize - partial.size());
+        const size_t count = min(missing, bytes.size());
+        partial.insert(partial.end(), bytes.begin(), bytes.begin() + count);
+        return bytes.subspan(count);
+    }
+};
+
+} // namespace ks3::detail
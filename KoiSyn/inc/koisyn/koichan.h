@@ -4,6 +4,13 @@
 #include "msquic.h"
 #include "udpsocket.h"
 #include "shared_handle.h"
+#include "buffer_pool.h"
+#include "ring_queue.h"
+#include "path_policy.h"
+#include "fec.h"
+#include "fragment.h"
+#include "packet_window.h"
+#include "framing.h"
 
 namespace ks3::detail
 {
@@ -19,33 +26,142 @@ struct DatagramChannel
     mutex RecvMutex;
     SharedConnection Self; // Connection started by us
     SharedConnection Peer; // Connection received passively
-    uint32_t NextRecvPacket = 0;
-    uint32_t NextSendPacket = 0;
-    uint16_t MaxSendLength = 0;
+    PacketWindow Window;
+
+    // Any thread may send, so the send state is atomic.
+    atomic_uint32_t NextSendPacket = 0;
+    atomic_uint16_t MaxSendLength = 0;
+    atomic_uint16_t NextMessageId = 0; // of the messages sent in fragments
+    PathPolicy Policy;
+
+    // Held by the thread adding a datagram to the parity. The others wait
+    // briefly, then leave their datagrams out of the group and count them.
+    atomic_flag ParityBusy;
+    ParityEncoder Parity;
+    atomic_uint64_t ParitySkipped = 0;
+
+    // Allocated when the peer starts sending parity.
+    unique_ptr<ParityDecoder> Recovery;
+
+    FragmentAssembler Fragments;
 
     void Reset() noexcept
     {
         Self = {};
         Peer = {};
+        Policy.Reset();
+        Parity.Reset();
         lock_guard _{RecvMutex};
-        NextRecvPacket = 0;
+        Recovery.reset();
+        Fragments.Reset();
+        Window.Reset();
         NextSendPacket = 0;
         MaxSendLength = 0;
+        NextMessageId = 0;
+        ParitySkipped = 0;
     }
 };
 
+struct RawBuffer;
+struct ReceiveLease;
+struct ConnectionContext;
+
+// The callback context of a stream, so that its events know the channel
+// without asking msquic for the stream ID.
+struct StreamContext
+{
+    ConnectionContext *Connection = nullptr;
+    uint8_t Index = 0;     // of the reliable channel
+    uint8_t Direction = 0; // 0: Self, 1: Peer
+};
+
+// A message queued for both streams of a StreamChannel.
+struct SendRequest
+{
+    RawBuffer *Buffer = nullptr;
+    const QUIC_BUFFER *Buffers = nullptr;
+    uint32_t Count = 0;
+    uint32_t Streams = 0; // counted in SendingBytes when queued
+    bool Chunk = false;   // of a streaming send
+};
+
 // TCP-like channel that is reliable.
 struct StreamChannel
 {
     mutex RecvMutex;
-    vector<uint8_t> Buffer;
+    FrameParser Parser;
     SharedStream Self; // Stream started by us
     SharedStream Peer; // Stream received passively
+    array<StreamContext, 2> Contexts; // of Self and Peer
     uint64_t NextRecvByte = 0;
 
-    StreamChannel() noexcept
+    // Messages framed and waiting for KoiChan::Flush(). It is sent as is
+    // even if the streams are reset meanwhile, so it is kept.
+    RawBuffer *Batch = nullptr;
+
+    // A large message is being sent in chunks (see
+    // KoiChan::ReliableStreamSend), so no other message can be sent until
+    // it is done. A message checked just before it was set is held in
+    // Deferred instead.
+    atomic_bool Streaming = false;
+
+    static constexpr size_t SEND_QUEUE_SIZE = 64;
+    static constexpr uint32_t MAX_DEFERRED_SENDS = 32;
+
+    // Senders on several threads must put their messages on the two streams
+    // in the same order, since the receiver splices them by offset. So they
+    // queue them, and one thread at a time, the submitter, passes the queue
+    // to msquic. A sender that finds another submitting leaves its message
+    // to it. msquic may complete a chunk inline, and the completion queues
+    // the next one on the submitter.
+    MpscRingQueue<SendRequest, SEND_QUEUE_SIZE> SendQueue;
+    atomic_int Queued = 0; // counted after the push, so it may dip below 0
+    atomic_bool Submitting = false;
+    atomic<thread::id> Submitter;
+
+    // The streaming send is done, so the submitter sends the deferred.
+    atomic_bool StreamEnded = false;
+
+    // Only the submitter uses these. The chunks of a streaming send are on
+    // the streams, so a message queued after the first is deferred until
+    // StreamEnded.
+    bool InStream = false;
+    uint32_t DeferredCount = 0;
+    array<SendRequest, MAX_DEFERRED_SENDS> Deferred;
+
+    // Bytes passed to StreamSend and not completed yet, on both streams. Like
+    // ConnectionContext::SendingBytes, it is not reset.
+    atomic_uint64_t SendingBytes = 0;
+
+    // The ideal send buffer size msquic reports for the Self and the Peer
+    // stream. Every byte goes on both, so the budget is their sum.
+    static constexpr uint64_t DEFAULT_IDEAL_SEND_BYTES = 128 * 1024;
+    array<atomic_uint64_t, 2> IdealSendBytes
+    {
+        DEFAULT_IDEAL_SEND_BYTES, DEFAULT_IDEAL_SEND_BYTES,
+    };
+
+    // A send would have blocked, so Kontext::OnWritable is owed.
+    atomic_bool Blocked = false;
+
+    // The receives we returned QUIC_STATUS_PENDING for, linked by
+    // ReceiveLease::Next, until the messages delivered in place from them
+    // are released. See Kontext::OnDeferredReceive.
+    mutex PendingMutex;
+    ReceiveLease *PendingReceives = nullptr;
+
+    StreamChannel() noexcept = default;
+    StreamChannel(const StreamChannel &) = delete;
+    void operator=(const StreamChannel &) = delete;
+
+    ~StreamChannel() noexcept
+    {
+        if (Batch != nullptr) { GetSendBufferPool().Free(Batch); }
+    }
+
+    [[nodiscard]] uint64_t GetSendBudget() const noexcept
     {
-        Buffer.reserve(1500);
+        return IdealSendBytes[0] + IdealSendBytes[1];
     }
 
     void Reset() noexcept
@@ -53,7 +169,7 @@ struct StreamChannel
         Self = {};
         Peer = {};
         lock_guard _{RecvMutex};
-        Buffer.clear();
+        Parser.Reset();
         NextRecvByte = 0;
     }
 };
@@ -68,6 +184,18 @@ struct ConnectionContext
 {
     mutex ModifyMutex;
     weak_ptr<void> ChannelContext;
+
+    // A strong reference to ChannelContext taken once the connection is
+    // accepted, so that the callbacks don't lock the weak_ptr per packet. It
+    // is kept until neither connection can call back (RefCount is 0), so a
+    // pointer from it stays valid during a callback.
+    shared_ptr<void> StrongChannelContext;
+
+    // Incremented by Reset(), so that the callbacks and the queued messages
+    // of the previous peer of a reused context are dropped.
+    atomic_uint32_t Generation;
+    uint32_t AcceptedGeneration = 0;
+
     class KoiSession *pSession;
     QUIC_ADDR RemoteSentinel;
 
@@ -91,21 +219,48 @@ struct ConnectionContext
 
     atomic_uint32_t RefCount;
 
+    // Bytes passed to StreamSend and not completed yet, on all streams. It is
+    // not reset with the context since the completions will come later.
+    atomic_uint64_t SendingBytes;
+
+    // The thread between KoiChan::BeginFrame() and Flush(). It owns the
+    // batches, and the messages of the other threads go at once.
+    atomic<thread::id> BatchingThread;
+
     ConnectionContext() noexcept :
         pSession{},
         RemoteSentinel{},
-        Ports{} {}
+        Ports{}
+    {
+        for (uint8_t i = 0; i < 4; ++i)
+        {
+            Reliable[i].Contexts[0] = {this, i, 0};
+            Reliable[i].Contexts[1] = {this, i, 1};
+        }
+    }
+
+    // The channel context for a callback, or null if the context is reset
+    // or the user has dropped the channel context (we hold the last
+    // reference).
+    [[nodiscard]] void *GetChannelContext() const noexcept
+    {
+        if (Generation != AcceptedGeneration) { return nullptr; }
+        if (StrongChannelContext.use_count() <= 1) { return nullptr; }
+        return StrongChannelContext.get();
+    }
 
     // Close both client (send) side and server (receive) side.
     // Don't clean pSession.
     void Reset() noexcept
     {
+        ++Generation;
         Reliable[0].Reset();
         Reliable[1].Reset();
         Reliable[2].Reset();
         Reliable[3].Reset();
         Unreliable.Reset();
         ChannelContext.reset();
+        if (RefCount == 0) { StrongChannelContext.reset(); }
         RemoteSentinel = {};
         HandshakeBegin = {};
         Transient = {};
@@ -113,12 +268,38 @@ struct ConnectionContext
     }
 };
 
+// Called once msquic no longer uses the memory of a message sent without
+// copying. See KoiChan::ReliableGatherSend.
+using SendCompletion = void (void *context) noexcept;
+
+// Reports the bytes of a streaming send completed so far, or that it has
+// failed (once, and nothing follows). See KoiChan::ReliableStreamSend.
+using StreamProgress = void (
+    void *context,
+    uint64_t sentBytes,
+    uint64_t totalBytes,
+    bool failed
+    ) noexcept;
+
+enum class SendResult : uint8_t
+{
+    Sent,
+    WouldBlock, // over the send budget; see KoiChan::ReliableTrySend
+    Failed,
+};
+
 #pragma warning(push)
 #pragma warning(disable: 4200) // warning C4200: nonstandard extension used: zero-sized array in struct/union
 
+// The header (packet length or number) is sent right before Data, so it
+// must stay the last member. A reliable message is prefixed with its length
+// as a varint of up to 3 bytes, which ends there as well. A gather send puts
+// its QUIC_BUFFERs in Data instead of the message.
 struct RawBuffer
 {
     QUIC_BUFFER Buffer;
+    SendCompletion *OnComplete;
+    void *Context;
     atomic_uint32_t RefCount;
     uint32_t PacketLengthOrNumber;
     uint8_t Data[];
@@ -126,9 +307,134 @@ struct RawBuffer
 
 #pragma warning(pop)
 
+// Buffers are allocated from the send buffer pool; see BufferPool.
+inline void FreeRawBuffer(RawBuffer *buffer) noexcept
+{
+    if (buffer->OnComplete != nullptr)
+    {
+        buffer->OnComplete(buffer->Context);
+    }
+    GetSendBufferPool().Free(buffer);
+}
+
+inline void ReleaseRawBuffer(RawBuffer *buffer) noexcept
+{
+    if (--buffer->RefCount == 0) { FreeRawBuffer(buffer); }
+}
+
+// Keeps the buffers of a receive for the messages delivered from them in
+// place. The last release completes the receive, so msquic frees them and
+// indicates more. If the stream is done meanwhile, we close it then instead.
+// A message split between receives is copied, and the lease owns the copy.
+struct ReceiveLease
+{
+    atomic_uint32_t RefCount = 1;
+    StreamChannel *Channel = nullptr; // nullptr if it owns a copy
+    HQUIC Stream = nullptr;
+    uint64_t Length = 0;
+    bool Closed = false; // StreamClose is ours to call
+    ReceiveLease *Next = nullptr;
+    vector<uint8_t> Copy{};
+};
+
+// Make the last release of the lease complete the receive.
+inline void AddPendingReceive(ReceiveLease *lease) noexcept
+{
+    StreamChannel &chn = *lease->Channel;
+    lock_guard _{chn.PendingMutex};
+    lease->Next = chn.PendingReceives;
+    chn.PendingReceives = lease;
+}
+
+// Return whether the lease was pending, and unlink it. The caller holds
+// StreamChannel::PendingMutex.
+inline bool RemovePendingReceive(ReceiveLease *lease) noexcept
+{
+    StreamChannel &chn = *lease->Channel;
+    for (ReceiveLease **p = &chn.PendingReceives; *p; p = &(*p)->Next)
+    {
+        if (*p == lease)
+        {
+            *p = lease->Next;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The stream is done with. Return false if a pending receive still holds
+// it; the last release closes it then.
+inline bool ClosePendingStream(StreamChannel &chn, HQUIC strm) noexcept
+{
+    lock_guard _{chn.PendingMutex};
+    for (ReceiveLease *p = chn.PendingReceives; p; p = p->Next)
+    {
+        if (p->Stream == strm)
+        {
+            p->Closed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void ReleaseReceiveLease(ReceiveLease *lease) noexcept
+{
+    if (--lease->RefCount != 0) { return; }
+    if (lease->Channel != nullptr)
+    {
+        lock_guard _{lease->Channel->PendingMutex};
+        if (RemovePendingReceive(lease))
+        {
+            if (lease->Closed) { MsQuic->StreamClose(lease->Stream); }
+            else
+            {
+                MsQuic->StreamReceiveComplete(lease->Stream, lease->Length);
+            }
+        }
+    }
+    delete lease;
+}
+
+// A reliable message delivered in place; see Kontext::OnDeferredReceive.
+// Data is valid until Release(), which must be called once, on any thread.
+struct ReceivedMessage
+{
+    span<const uint8_t> Data;
+    ReceiveLease *Lease;
+
+    void Release() noexcept { ReleaseReceiveLease(Lease); }
+};
+
 class KoiChan
 {
 public:
+    // Now we only accept packet size <= 65512 for now.
+    static constexpr size_t MAX_RELIABLE_SIZE = 65512;
+
+    // The parts of a message sent without copying.
+    static constexpr size_t MAX_GATHER_PARTS = 16;
+
+    // A datagram message longer than a datagram is sent in fragments.
+    static constexpr size_t MAX_UNRELIABLE_SIZE = 65535;
+
+    // The framed messages batched in a buffer of the pool. A message larger
+    // than it is sent alone.
+    static constexpr uint32_t BATCH_CAPACITY =
+        BufferPool::BLOCK_SIZES[1] - sizeof(RawBuffer);
+
+    // A streaming send keeps the send budget of the channel in msquic, in
+    // chunks, but no more than the maximum, so that the other streams of the
+    // connection get their share. Sends complete on ack, so the window is
+    // what is in flight on the network.
+    static constexpr uint32_t STREAM_CHUNK_SIZE = 64 * 1024;
+    static constexpr int MIN_STREAM_CHUNKS_IN_FLIGHT = 4;
+    static constexpr int MAX_STREAM_CHUNKS_IN_FLIGHT = 32;
+
+    // A thread that finds another adding to the parity yields this many
+    // times before it leaves its datagram out of the group.
+    static constexpr int MAX_PARITY_SPINS = 16;
+
     void *handle;
 
 public:
@@ -164,6 +470,40 @@ public:
         return ReliablePacketSend(3, data);
     }
 
+    // Batch the reliable messages this thread sends from now on until
+    // Flush(), so that every channel sends them in one StreamSend per stream
+    // instead of one per message. One thread batches at a time, e.g. the
+    // game loop; the messages of the others go at once.
+    // Return false if another thread is batching.
+    bool BeginFrame() noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return false; }
+
+        thread::id owner;
+        const thread::id self = this_thread::get_id();
+        return pctx->BatchingThread.compare_exchange_strong(owner, self) or
+            owner == self;
+    }
+
+    // Send the batched messages and stop batching. A message batched is
+    // reported sent by ReliablePacketSend(), so its failure is reported here.
+    // Return false if the messages of any channel can't be sent.
+    bool Flush() noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return false; }
+        if (not OwnsBatches(*pctx)) { return true; }
+
+        bool sent = true;
+        for (uint32_t channel = 0; channel < 4; ++channel)
+        {
+            sent &= SendBatch(*pctx, channel);
+        }
+        pctx->BatchingThread = thread::id{};
+        return sent;
+    }
+
     bool ReliablePacketSend(
         uint32_t channel,
         span<const uint8_t> data
@@ -172,115 +512,926 @@ public:
         ConnectionContext *pctx = (ConnectionContext *)handle;
         if (pctx == nullptr) { return false; }
 
-        // Now we only accept packet size <= 65512 for now.
-        if (data.size() > 65512) { return false; }
+        if (data.size() > MAX_RELIABLE_SIZE) { return false; }
         if (channel >= 4) [[unlikely]] { return false; }
-        StreamChannel &chn = pctx->Reliable[channel];
+        if (pctx->Reliable[channel].Streaming) { return false; }
+
+        // The messages batched before go first.
+        if (OwnsBatches(*pctx) and AppendToBatch(*pctx, channel, data))
+        {
+            return true;
+        }
+        SendBatch(*pctx, channel);
 
         optional maybeRawBuffer = MakeBuffer(data);
         if (not maybeRawBuffer) { return false; }
         RawBuffer *rawBuffer = *maybeRawBuffer;
-        rawBuffer->PacketLengthOrNumber = htonl((uint32_t)data.size());
+        SetLengthPrefix(rawBuffer, (uint32_t)data.size());
 
-        SharedStream peer = chn.Peer;
-        SharedStream self = chn.Self;
+        return SendOnStreams(
+            *pctx, pctx->Reliable[channel], rawBuffer, &rawBuffer->Buffer, 1);
+    }
 
-        bool sent = false;
+    // Like ReliablePacketSend, within the send budget of the channel. If the
+    // bytes in flight on it reach the budget, nothing is sent and it returns
+    // WouldBlock; Kontext::OnWritable is called for the channel once they
+    // drop below. Meanwhile the app can drop or merge stale messages instead
+    // of queuing them in msquic.
+    SendResult ReliableTrySend(
+        uint32_t channel,
+        span<const uint8_t> data
+        ) noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return SendResult::Failed; }
+        if (channel >= 4) [[unlikely]] { return SendResult::Failed; }
 
-        // The reason we split it into two loop is, if the first sending is
-        // done before the second sending start, the allocated memory will be
-        // delete in advance and the second sending will cause memory access
-        // violation.
-        // We delete it in the handler of
-        // QUIC_STREAM_EVENT_SEND_COMPLETE at koisession.h .
-        for (HQUIC strm : { peer.get(), self.get() })
+        StreamChannel &chn = pctx->Reliable[channel];
+        if (GetPendingBytes(*pctx, channel) >= chn.GetSendBudget())
         {
-            if (strm == nullptr) { continue; }
-            ++rawBuffer->RefCount;
+            // If the bytes complete before Blocked is set, we see it here;
+            // OnWritable may still come, which is harmless.
+            chn.Blocked = true;
+            if (GetPendingBytes(*pctx, channel) >= chn.GetSendBudget())
+            {
+                return SendResult::WouldBlock;
+            }
         }
 
-        for (HQUIC strm : { peer.get(), self.get() })
+        return ReliablePacketSend(channel, data) ?
+            SendResult::Sent : SendResult::Failed;
+    }
+
+    // Send a message made of the parts, in order, without copying them. The
+    // parts must stay valid until onComplete(context) is called, on a msquic
+    // worker thread or a thread sending on the channel. If it returns false,
+    // the parts are not used and onComplete is not called.
+    bool ReliableGatherSend(
+        uint32_t channel,
+        span<const span<const uint8_t>> parts,
+        SendCompletion *onComplete,
+        void *context
+        ) noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return false; }
+        if (channel >= 4) [[unlikely]] { return false; }
+        if (pctx->Reliable[channel].Streaming) { return false; }
+
+        optional maybeRawBuffer =
+            MakeGatherBuffer(parts, MAX_RELIABLE_SIZE, onComplete, context);
+        if (not maybeRawBuffer) { return false; }
+        RawBuffer *rawBuffer = *maybeRawBuffer;
+        const uint32_t size = rawBuffer->Buffer.Length - 4;
+        SetLengthPrefix(rawBuffer, size);
+        QUIC_BUFFER *buffers = (QUIC_BUFFER *)rawBuffer->Data;
+        buffers[0] = {
+            rawBuffer->Buffer.Length - size, rawBuffer->Buffer.Buffer};
+        SendBatch(*pctx, channel);
+
+        return SendOnStreams(*pctx, pctx->Reliable[channel], rawBuffer,
+            (QUIC_BUFFER *)rawBuffer->Data, (uint32_t)parts.size() + 1);
+    }
+
+    // Send a message of up to 4 GiB, e.g. a snapshot, in chunks straight
+    // from the data. The receiver gets it as one message. onProgress is
+    // called on a msquic worker thread as the chunks complete, and the data
+    // must stay valid until it reports all of the bytes or the failure.
+    //
+    // No other message can be sent on the channel until then (the sends
+    // fail), so give large messages a channel of their own; the other
+    // channels are separate streams and go on meanwhile. If a chunk can't be
+    // sent after the first, the receiver is left in the middle of the
+    // message, so we disconnect.
+    // Return false if it can't start; then onProgress is not called.
+    bool ReliableStreamSend(
+        uint32_t channel,
+        span<const uint8_t> data,
+        StreamProgress *onProgress,
+        void *context
+        ) noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return false; }
+        if (channel >= 4) [[unlikely]] { return false; }
+        if (data.size() > UINT32_MAX or onProgress == nullptr) [[unlikely]]
         {
-            if (strm == nullptr) { continue; }
-            QUIC_STATUS status = MsQuic->StreamSend(
-                strm,
-                &rawBuffer->Buffer,
-                1,
-                QUIC_SEND_FLAG_ALLOW_0_RTT,
-                rawBuffer);
-            sent |= QUIC_SUCCEEDED(status);
+            return false;
         }
 
-        if (not sent) { delete[] rawBuffer; }
+        // The batch goes before the first chunk, and the later messages
+        // fail. One queued by another thread as we claim the channel waits
+        // until we are done; see StreamChannel::Deferred.
+        StreamChannel &chn = pctx->Reliable[channel];
+        SendBatch(*pctx, channel);
+        bool idle = false;
+        if (not chn.Streaming.compare_exchange_strong(idle, true))
+        {
+            return false;
+        }
 
-        return sent;
+        StreamingSend *send = new(nothrow) StreamingSend{
+            .Context = pctx, .Channel = channel, .Data = data,
+            .OnProgress = onProgress, .ProgressContext = context};
+        if (send == nullptr) [[unlikely]]
+        {
+            chn.Streaming = false;
+            return false;
+        }
+
+        HeldChunks held;
+        unique_lock lock{send->Mutex};
+        const bool pumped = PumpStream(*send, held);
+        if (not pumped and not send->HeaderSent)
+        {
+            // Nothing is on the wire, so the channel is still usable.
+            lock.unlock();
+            chn.Streaming = false;
+            delete send;
+            return false;
+        }
+        send->Failed = not pumped;
+        lock.unlock();
+
+        held.Release();
+        if (not pumped) { FailStream(*send, 0); }
+        ReleaseStream(send);
+        return true;
+    }
+
+    // Send the same message to many channels, e.g. spectators, with only one
+    // copy of the data shared by all of them. Channels whose sending bytes
+    // exceed `maxSendingBytes` are skipped so a slow receiver can't make us
+    // buffer without limit.
+    // Return the number of channels sent to.
+    static size_t ReliableMulticast(
+        span<const KoiChan> channels,
+        uint32_t channel,
+        span<const uint8_t> data,
+        uint64_t maxSendingBytes = UINT64_MAX
+        ) noexcept
+    {
+        if (data.size() > MAX_RELIABLE_SIZE) { return 0; }
+        if (channel >= 4) [[unlikely]] { return 0; }
+
+        optional maybeRawBuffer = MakeBuffer(data);
+        if (not maybeRawBuffer) { return 0; }
+        RawBuffer *rawBuffer = *maybeRawBuffer;
+        SetLengthPrefix(rawBuffer, (uint32_t)data.size());
+
+        // Hold a reference while sending, so that a completion on another
+        // thread can't delete it before we finish the loop.
+        ++rawBuffer->RefCount;
+
+        size_t sentChannels = 0;
+        for (const KoiChan &chan : channels)
+        {
+            ConnectionContext *pctx = (ConnectionContext *)chan.handle;
+            if (pctx == nullptr) { continue; }
+            if (pctx->SendingBytes > maxSendingBytes) { continue; }
+            if (pctx->Reliable[channel].Streaming) { continue; }
+
+            SendBatch(*pctx, channel);
+            sentChannels += SendOnStreams(*pctx, pctx->Reliable[channel],
+                rawBuffer, &rawBuffer->Buffer, 1);
+        }
+
+        ReleaseRawBuffer(rawBuffer);
+
+        return sentChannels;
+    }
+
+    // Bytes sent on the reliable channels and not acknowledged yet.
+    uint64_t GetSendingBytes() const noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return 0; }
+        return pctx->SendingBytes;
+    }
+
+    // Bytes sent or batched on the channel and not acknowledged yet.
+    uint64_t GetSendingBytes(uint32_t channel) const noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr or channel >= 4) { return 0; }
+        return GetPendingBytes(*pctx, channel);
     }
 
+    // See ReliableTrySend.
+    uint64_t GetSendBudget(uint32_t channel) const noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr or channel >= 4) { return 0; }
+        return pctx->Reliable[channel].GetSendBudget();
+    }
+
+    // Datagrams left out of the parity because other threads were adding to
+    // it; they can't be rebuilt if lost.
+    uint64_t GetParitySkipped() const noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return 0; }
+        return pctx->Unreliable.ParitySkipped;
+    }
+
+    // A message longer than a datagram is split into fragments, and the
+    // receiver gets it once all of them arrive (see FragmentAssembler).
     bool UnreliablePacketSend(span<const uint8_t> data) noexcept
     {
         ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return false; }
 
         // The size can be sent in a packet may vary, depending on IPv4 / IPv6
         // and other factor.
         DatagramChannel &chn = pctx->Unreliable;
-        if (data.size() > chn.MaxSendLength) { return false; }
-
-        uint32_t number = chn.NextSendPacket++;
+        const size_t maxPayload = GetMaxPayload(chn);
+        if (data.size() > maxPayload)
+        {
+            return SendFragments(chn, data, maxPayload);
+        }
 
         optional maybeRawBuffer = MakeBuffer(data);
         if (not maybeRawBuffer) { return false; }
         RawBuffer *rawBuffer = *maybeRawBuffer;
+        const uint32_t number = chn.NextSendPacket++ & PACKET_NUMBER_MASK;
         rawBuffer->PacketLengthOrNumber = htonl(number);
 
-        SharedConnection peer = chn.Peer;
-        SharedConnection self = chn.Self;
+        const bool sent =
+            SendOnConnections(chn, rawBuffer, &rawBuffer->Buffer, 1);
+        AddParity(chn, number, span{&data, 1});
+        return sent;
+    }
 
-        bool sent = false;
+    // Datagrams go on the better of our two connections to the peer by
+    // default (see PathPolicy). Reliable messages always go on both: the
+    // receiver reads every byte of a channel from whichever stream it
+    // arrives on first, so both streams must carry all of them.
+    void SetDuplicateMode(DuplicateMode mode) noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return; }
+        pctx->Unreliable.Policy.SetMode(mode);
+    }
+
+    // Send a parity datagram after every groupSize datagrams, from which
+    // the peer rebuilds one of them lost (see ParityEncoder). Pass 0 to turn
+    // it off (the default), or ADAPTIVE_FEC to follow the loss.
+    void SetFecGroupSize(int groupSize) noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return; }
+        pctx->Unreliable.Parity.SetGroupSize(groupSize);
+    }
+
+    // Like ReliableGatherSend, on the datagram channel.
+    bool UnreliableGatherSend(
+        span<const span<const uint8_t>> parts,
+        SendCompletion *onComplete,
+        void *context
+        ) noexcept
+    {
+        ConnectionContext *pctx = (ConnectionContext *)handle;
+        if (pctx == nullptr) { return false; }
+
+        DatagramChannel &chn = pctx->Unreliable;
+        optional maybeRawBuffer =
+            MakeGatherBuffer(parts, GetMaxPayload(chn), onComplete, context);
+        if (not maybeRawBuffer) { return false; }
+        RawBuffer *rawBuffer = *maybeRawBuffer;
+        const uint32_t number = chn.NextSendPacket++ & PACKET_NUMBER_MASK;
+        rawBuffer->PacketLengthOrNumber = htonl(number);
+
+        const bool sent = SendOnConnections(chn, rawBuffer,
+            (QUIC_BUFFER *)rawBuffer->Data, (uint32_t)parts.size() + 1);
+        AddParity(chn, number, parts);
+        return sent;
+    }
+
+private:
+    friend class KoiSession;
+
+    KoiChan() noexcept : handle{} {};
+    KoiChan(ConnectionContext &ctx) noexcept : handle{&ctx} {}
+
+    // Pass the message to msquic on both streams, in the same order as the
+    // other senders. We release the buffer in the handler of
+    // QUIC_STREAM_EVENT_SEND_COMPLETE at koisession.h . If it goes on no
+    // stream, the buffer is freed without completing, unless another thread
+    // was submitting: then we have already returned true, and it completes
+    // as if canceled (see DropRequest).
+    static bool SendOnStreams(
+        ConnectionContext &ctx,
+        StreamChannel &chn,
+        RawBuffer *rawBuffer,
+        const QUIC_BUFFER *buffers,
+        uint32_t count,
+        bool chunk = false
+        ) noexcept
+    {
+        const uint32_t streams =
+            (chn.Peer.get() != nullptr) + (chn.Self.get() != nullptr);
+        const uint64_t length = rawBuffer->Buffer.Length;
+
+        ++rawBuffer->RefCount; // the queue's
+        if (streams == 0) { return Finish(rawBuffer, false); }
+        ctx.SendingBytes += streams * length;
+        chn.SendingBytes += streams * length;
+        const SendRequest request{rawBuffer, buffers, count, streams, chunk};
+
+        // Nobody is submitting, so we send the queue and then the message
+        // ourselves.
+        if (not chn.Submitting.exchange(true))
+        {
+            chn.Submitter = this_thread::get_id();
+            const int drained = DrainSendQueue(ctx, chn);
+            bool sent = true;
+            if (chunk or not chn.InStream)
+            {
+                sent = StreamOnBoth(ctx, chn, request);
+                chn.InStream |= chunk and sent;
+                Finish(rawBuffer, sent);
+            }
+            else { SubmitRequest(ctx, chn, request); }
+            if (EndSubmit(chn, drained)) { Submit(ctx, chn); }
+            return sent;
+        }
+
+        while (not chn.SendQueue.TryPush(request))
+        {
+            // The submitter is behind, and it can't wait for itself.
+            if (chn.Submitter.load() == this_thread::get_id())
+            {
+                ctx.SendingBytes -= streams * length;
+                chn.SendingBytes -= streams * length;
+                return Finish(rawBuffer, false);
+            }
+            Submit(ctx, chn);
+            this_thread::yield();
+        }
+        ++chn.Queued;
+        Submit(ctx, chn);
+        return true;
+    }
+
+    // Become the submitter, unless another thread is, and pass the queued
+    // messages to msquic.
+    static void Submit(ConnectionContext &ctx, StreamChannel &chn) noexcept
+    {
+        while (not chn.Submitting.exchange(true))
+        {
+            chn.Submitter = this_thread::get_id();
+            if (not EndSubmit(chn, DrainSendQueue(ctx, chn))) { return; }
+        }
+    }
+
+    // Stop submitting. Return true if the queue needs a submitter again: a
+    // sender that found us submitting left its message to us. If it is
+    // behind a slot another sender is still writing, we wait for it.
+    static bool EndSubmit(StreamChannel &chn, int drained) noexcept
+    {
+        chn.Queued -= drained;
+        chn.Submitter = thread::id{};
+        chn.Submitting = false;
+        if (chn.Queued <= 0 and not chn.StreamEnded) { return false; }
+        if (drained == 0) { this_thread::yield(); }
+        return true;
+    }
+
+    // Return the number of messages drained.
+    static int DrainSendQueue(ConnectionContext &ctx, StreamChannel &chn)
+        noexcept
+    {
+        int drained = 0;
+        while (const size_t count = chn.SendQueue.Drain(
+            [&](const SendRequest &request) noexcept
+            {
+                SubmitRequest(ctx, chn, request);
+            }))
+        {
+            drained += (int)count;
+        }
+        if (chn.StreamEnded.exchange(false)) { SendDeferred(ctx, chn); }
+        return drained;
+    }
+
+    static void SubmitRequest(
+        ConnectionContext &ctx,
+        StreamChannel &chn,
+        const SendRequest &request
+        ) noexcept
+    {
+        if (chn.StreamEnded and chn.StreamEnded.exchange(false))
+        {
+            SendDeferred(ctx, chn);
+        }
+        if (request.Chunk)
+        {
+            chn.InStream = true;
+        }
+        else if (chn.InStream)
+        {
+            if (chn.DeferredCount < StreamChannel::MAX_DEFERRED_SENDS)
+            {
+                chn.Deferred[chn.DeferredCount++] = request;
+                return;
+            }
+            // Too many raced with the streaming send. Sending it now would
+            // split the large message, so it is lost like on a reset stream.
+            const uint64_t counted =
+                request.Streams * (uint64_t)request.Buffer->Buffer.Length;
+            ctx.SendingBytes -= counted;
+            chn.SendingBytes -= counted;
+            DropRequest(request);
+            return;
+        }
+        SendQueued(ctx, chn, request);
+    }
 
-        // The reason we split it into two loop is, if the first sending is
-        // done before the second sending start, the allocated memory will be
-        // delete in advance and the second sending will cause memory access
-        // violation.
-        // We delete it in the handler of
-        // QUIC_CONNECTION_EVENT_DATAGRAM_SEND_STATE_CHANGED at koisession.h .
-        for (HQUIC conn : { peer.get(), self.get() })
+    static void SendQueued(
+        ConnectionContext &ctx,
+        StreamChannel &chn,
+        const SendRequest &request
+        ) noexcept
+    {
+        if (StreamOnBoth(ctx, chn, request))
         {
-            if (conn == nullptr) { continue; }
+            ReleaseRawBuffer(request.Buffer);
+        }
+        else { DropRequest(request); }
+    }
+
+    static void SendDeferred(ConnectionContext &ctx, StreamChannel &chn)
+        noexcept
+    {
+        chn.InStream = false;
+        for (uint32_t i = 0; i < chn.DeferredCount; ++i)
+        {
+            SendQueued(ctx, chn, chn.Deferred[i]);
+        }
+        chn.DeferredCount = 0;
+    }
+
+    // The queue holds a reference while we send, so that if the first
+    // sending is done before the second one starts, the buffer is not
+    // deleted in advance. Return false if it went on no stream.
+    static bool StreamOnBoth(
+        ConnectionContext &ctx,
+        StreamChannel &chn,
+        const SendRequest &request
+        ) noexcept
+    {
+        RawBuffer *rawBuffer = request.Buffer;
+        const uint64_t length = rawBuffer->Buffer.Length;
+        SharedStream peer = chn.Peer;
+        SharedStream self = chn.Self;
+
+        uint32_t counted = request.Streams;
+        bool sent = false;
+        for (HQUIC strm : { peer.get(), self.get() })
+        {
+            if (strm == nullptr) { continue; }
+            if (counted != 0) { --counted; }
+            else
+            {
+                ctx.SendingBytes += length;
+                chn.SendingBytes += length;
+            }
             ++rawBuffer->RefCount;
+            QUIC_STATUS status = MsQuic->StreamSend(
+                strm,
+                request.Buffers,
+                request.Count,
+                QUIC_SEND_FLAG_ALLOW_0_RTT,
+                rawBuffer);
+            if (QUIC_FAILED(status))
+            {
+                ctx.SendingBytes -= length;
+                chn.SendingBytes -= length;
+                --rawBuffer->RefCount;
+                continue;
+            }
+            sent = true;
         }
+        ctx.SendingBytes -= counted * length;
+        chn.SendingBytes -= counted * length;
+        return sent;
+    }
 
-        for (HQUIC conn : { peer.get(), self.get() })
+    // Release the queue's reference of a message that went on no stream
+    // after its sender returned. It completes as if canceled, but a chunk
+    // fails its streaming send instead.
+    static void DropRequest(const SendRequest &request) noexcept
+    {
+        RawBuffer *rawBuffer = request.Buffer;
+        if (not request.Chunk)
         {
-            if (conn == nullptr) { continue; }
+            ReleaseRawBuffer(rawBuffer);
+            return;
+        }
+
+        // OnChunkSent may not lock the StreamingSend here, so we drop the
+        // reference of the chunk ourselves.
+        StreamingSend *send = (StreamingSend *)rawBuffer->Context;
+        send->Lost = true;
+        rawBuffer->OnComplete = nullptr;
+        ReleaseRawBuffer(rawBuffer);
+        ReleaseStream(send);
+    }
+
+    // Like SendOnStreams, on the connections chosen by the policy. We
+    // release the buffer in the handler of
+    // QUIC_CONNECTION_EVENT_DATAGRAM_SEND_STATE_CHANGED at koisession.h .
+    static bool SendOnConnections(
+        DatagramChannel &chn,
+        RawBuffer *rawBuffer,
+        const QUIC_BUFFER *buffers,
+        uint32_t count
+        ) noexcept
+    {
+        SharedConnection peer = chn.Peer;
+        SharedConnection self = chn.Self;
+        const steady_clock::time_point now = steady_clock::now();
+        const int paths = chn.Policy.Choose(self.get(), peer.get(), now);
+
+        ++rawBuffer->RefCount;
+        int sentPaths = 0;
+        for (auto [conn, path] : {
+            pair{peer.get(), PathPolicy::PEER},
+            pair{self.get(), PathPolicy::SELF} })
+        {
+            if (conn == nullptr or (paths & path) == 0) { continue; }
+            ++rawBuffer->RefCount;
             QUIC_STATUS status = MsQuic->DatagramSend(
                 conn,
-                &rawBuffer->Buffer,
-                1,
+                buffers,
+                count,
                 QUIC_SEND_FLAG_ALLOW_0_RTT,
                 rawBuffer);
-            sent |= QUIC_SUCCEEDED(status);
+            if (QUIC_FAILED(status))
+            {
+                --rawBuffer->RefCount;
+                continue;
+            }
+            sentPaths |= path;
         }
+        chn.Policy.OnSent(sentPaths, now);
 
-        if (not sent) { delete[] rawBuffer; }
+        return Finish(rawBuffer, sentPaths != 0);
+    }
 
-        return sent;
+    [[nodiscard]] static bool OwnsBatches(const ConnectionContext &ctx)
+        noexcept
+    {
+        return ctx.BatchingThread.load(memory_order_relaxed) ==
+            this_thread::get_id();
     }
 
-private:
-    friend class KoiSession;
+    // Only the batching thread sees its batch.
+    [[nodiscard]] static uint64_t GetPendingBytes(
+        const ConnectionContext &ctx,
+        uint32_t channel
+        ) noexcept
+    {
+        const StreamChannel &chn = ctx.Reliable[channel];
+        const uint64_t batched = chn.Batch == nullptr or
+            not OwnsBatches(ctx) ? 0 : chn.Batch->Buffer.Length;
+        return chn.SendingBytes + batched;
+    }
 
-    KoiChan() noexcept : handle{} {};
-    KoiChan(ConnectionContext &ctx) noexcept : handle{&ctx} {}
+    // Return false if the message doesn't fit a batch, or the batch can't
+    // be allocated.
+    static bool AppendToBatch(
+        ConnectionContext &ctx,
+        uint32_t channel,
+        span<const uint8_t> data
+        ) noexcept
+    {
+        const uint32_t framed =
+            (uint32_t)(GetVarintSize(data.size()) + data.size());
+        if (framed > BATCH_CAPACITY) { return false; }
+
+        StreamChannel &chn = ctx.Reliable[channel];
+        if (chn.Batch != nullptr and
+            chn.Batch->Buffer.Length + framed > BATCH_CAPACITY)
+        {
+            SendBatch(ctx, channel);
+            if (chn.Batch != nullptr) { return false; } // kept, streaming
+        }
+        if (chn.Batch == nullptr)
+        {
+            chn.Batch = AllocateBuffer(BATCH_CAPACITY);
+            if (chn.Batch == nullptr) [[unlikely]] { return false; }
+            chn.Batch->Buffer.Buffer = chn.Batch->Data;
+            chn.Batch->Buffer.Length = 0;
+        }
 
-    optional<RawBuffer *> MakeBuffer(span<const uint8_t> data) noexcept
+        uint8_t *out = chn.Batch->Data + chn.Batch->Buffer.Length;
+        out += EncodeVarint(data.size(), span{out, framed});
+        memcpy(out, data.data(), data.size());
+        chn.Batch->Buffer.Length += framed;
+        return true;
+    }
+
+    // Return true if there is nothing to send, or the batches belong to
+    // another thread. A batch made before the channel started streaming is
+    // kept until it is done.
+    static bool SendBatch(ConnectionContext &ctx, uint32_t channel) noexcept
+    {
+        if (not OwnsBatches(ctx)) { return true; }
+        StreamChannel &chn = ctx.Reliable[channel];
+        if (chn.Batch == nullptr or chn.Streaming) { return true; }
+
+        RawBuffer *rawBuffer = exchange(chn.Batch, nullptr);
+        return SendOnStreams(ctx, chn, rawBuffer, &rawBuffer->Buffer, 1);
+    }
+
+    struct StreamingSend
+    {
+        ConnectionContext *Context = nullptr;
+        uint32_t Channel = 0;
+        span<const uint8_t> Data;
+        StreamProgress *OnProgress = nullptr;
+        void *ProgressContext = nullptr;
+
+        mutex Mutex{};
+        uint64_t Issued = 0;    // bytes of Data passed to msquic
+        uint64_t Completed = 0;
+        bool HeaderSent = false;
+        bool Failed = false;
+        int InFlight = 0;       // chunks
+
+        // A chunk went on no stream. The submitter sets it without the
+        // mutex, and the next to look reports the failure.
+        atomic_bool Lost = false;
+
+        // A reference for every chunk in flight and one for the caller.
+        atomic_int RefCount = 1;
+    };
+
+    // A chunk may be sent and complete before SendOnStreams returns, so we
+    // hold a reference to the chunks queued until the mutex of the
+    // StreamingSend is unlocked.
+    struct HeldChunks
+    {
+        array<RawBuffer *, MAX_STREAM_CHUNKS_IN_FLIGHT> Chunks;
+        int Count = 0;
+
+        void Release() noexcept
+        {
+            for (int i = 0; i < Count; ++i) { ReleaseRawBuffer(Chunks[i]); }
+            Count = 0;
+        }
+    };
+
+    // Queue chunks until the window is full. Lock the mutex.
+    // Return false if a chunk can't be sent.
+    static bool PumpStream(StreamingSend &send, HeldChunks &held) noexcept
+    {
+        const uint64_t total = send.Data.size();
+        // Every chunk goes on both streams.
+        const int window = (int)clamp<uint64_t>(
+            send.Context->Reliable[send.Channel].GetSendBudget() / 2 /
+                STREAM_CHUNK_SIZE,
+            MIN_STREAM_CHUNKS_IN_FLIGHT, MAX_STREAM_CHUNKS_IN_FLIGHT);
+        while (not send.Lost and
+            send.InFlight < window and
+            (not send.HeaderSent or send.Issued < total))
+        {
+            const size_t size =
+                (size_t)min<uint64_t>(STREAM_CHUNK_SIZE, total - send.Issued);
+            RawBuffer *rawBuffer =
+                AllocateBuffer(2 * sizeof(QUIC_BUFFER) + MAX_VARINT_SIZE);
+            if (rawBuffer == nullptr) [[unlikely]] { return false; }
+
+            // The first chunk begins with the length of the whole message,
+            // after the QUIC_BUFFERs.
+            QUIC_BUFFER *buffers = (QUIC_BUFFER *)rawBuffer->Data;
+            uint32_t count = 0;
+            uint32_t prefix = 0;
+            if (not send.HeaderSent)
+            {
+                uint8_t *header = rawBuffer->Data + 2 * sizeof(QUIC_BUFFER);
+                prefix = (uint32_t)EncodeVarint(
+                    total, span{header, MAX_VARINT_SIZE});
+                buffers[count++] = {prefix, header};
+            }
+            if (size != 0)
+            {
+                buffers[count++] = {(uint32_t)size,
+                    (uint8_t *)send.Data.data() + send.Issued};
+            }
+            rawBuffer->Buffer.Buffer = buffers[0].Buffer;
+            rawBuffer->Buffer.Length = prefix + (uint32_t)size;
+            rawBuffer->OnComplete = OnChunkSent;
+            rawBuffer->Context = &send;
+
+            ++send.InFlight;
+            ++send.RefCount;
+            ++rawBuffer->RefCount;
+            if (not SendOnStreams(*send.Context,
+                send.Context->Reliable[send.Channel], rawBuffer, buffers,
+                count, true))
+            {
+                // Not completing, so it can be freed under the lock.
+                --send.InFlight;
+                --send.RefCount;
+                ReleaseRawBuffer(rawBuffer);
+                return false;
+            }
+            held.Chunks[held.Count++] = rawBuffer;
+            send.HeaderSent = true;
+            send.Issued += size;
+        }
+        return not send.Lost;
+    }
+
+    static void OnChunkSent(void *context) noexcept
+    {
+        StreamingSend &send = *(StreamingSend *)context;
+        const uint64_t total = send.Data.size();
+
+        unique_lock lock{send.Mutex};
+        --send.InFlight;
+        if (send.Failed)
+        {
+            lock.unlock();
+            ReleaseStream(&send);
+            return;
+        }
+
+        // Chunks complete in order on a stream.
+        send.Completed += min<uint64_t>(STREAM_CHUNK_SIZE,
+            total - send.Completed);
+        const uint64_t completed = send.Completed;
+        HeldChunks held;
+        send.Failed = not PumpStream(send, held);
+        const bool failed = send.Failed;
+        lock.unlock();
+
+        held.Release();
+        if (failed) { FailStream(send, completed); }
+        else
+        {
+            send.OnProgress(send.ProgressContext, completed, total, false);
+        }
+        ReleaseStream(&send);
+    }
+
+    static void FailStream(StreamingSend &send, uint64_t completed) noexcept
+    {
+        send.OnProgress(
+            send.ProgressContext, completed, send.Data.size(), true);
+        ConnectionContext &ctx = *send.Context;
+        lock_guard _{ctx.ModifyMutex};
+        ctx.Reset();
+    }
+
+    // The channel is free again with the last reference, and the messages
+    // deferred meanwhile go.
+    static void ReleaseStream(StreamingSend *send) noexcept
+    {
+        if (--send->RefCount != 0) { return; }
+        if (send->Lost and not send->Failed)
+        {
+            FailStream(*send, send->Completed);
+        }
+        ConnectionContext &ctx = *send->Context;
+        StreamChannel &chn = ctx.Reliable[send->Channel];
+        delete send;
+        chn.StreamEnded = true;
+        chn.Streaming = false;
+        Submit(ctx, chn);
+    }
+
+    // The payload that fits a datagram after the packet number, as of the
+    // latest QUIC_CONNECTION_EVENT_DATAGRAM_STATE_CHANGED.
+    [[nodiscard]] static size_t GetMaxPayload(const DatagramChannel &chn)
+        noexcept
+    {
+        const uint16_t maxSendLength = chn.MaxSendLength;
+        return maxSendLength < 4 ? 0 : maxSendLength - 4;
+    }
+
+    // See FragmentHeader. Return false if a fragment can't be sent, since
+    // the message is lost then.
+    static bool SendFragments(
+        DatagramChannel &chn,
+        span<const uint8_t> data,
+        size_t maxPayload
+        ) noexcept
+    {
+        if (data.size() > MAX_UNRELIABLE_SIZE) { return false; }
+        if (maxPayload <= FragmentHeader::SIZE - 4) { return false; }
+
+        const size_t fragmentSize = maxPayload - (FragmentHeader::SIZE - 4);
+        const size_t count = (data.size() + fragmentSize - 1) / fragmentSize;
+        if (count > FragmentHeader::MAX_FRAGMENTS) { return false; }
+
+        FragmentHeader header{
+            .MessageId = chn.NextMessageId++,
+            .Index = 0,
+            .Count = (uint8_t)count,
+            .FragmentSize = (uint16_t)fragmentSize,
+        };
+        for (size_t offset = 0; offset < data.size(); offset += fragmentSize)
+        {
+            span<const uint8_t> part =
+                data.subspan(offset, min(fragmentSize, data.size() - offset));
+            RawBuffer *rawBuffer = AllocateBuffer(2 + (uint32_t)part.size());
+            if (rawBuffer == nullptr) [[unlikely]] { return false; }
+
+            rawBuffer->PacketLengthOrNumber = htonl(header.Encode());
+            rawBuffer->Data[0] = (uint8_t)(header.FragmentSize >> 8);
+            rawBuffer->Data[1] = (uint8_t)header.FragmentSize;
+            memcpy(rawBuffer->Data + 2, part.data(), part.size());
+            rawBuffer->Buffer.Buffer = rawBuffer->Data - 4;
+            rawBuffer->Buffer.Length = 6 + (uint32_t)part.size();
+            if (not SendOnConnections(chn, rawBuffer, &rawBuffer->Buffer, 1))
+            {
+                return false;
+            }
+            ++header.Index;
+        }
+        return true;
+    }
+
+    // A datagram lost on the way can be rebuilt, so we add it even if the
+    // send fails.
+    static void AddParity(
+        DatagramChannel &chn,
+        uint32_t number,
+        span<const span<const uint8_t>> parts
+        ) noexcept
+    {
+        if (chn.Parity.GetGroupSize() == 0) { return; }
+        for (int spins = 0;
+            chn.ParityBusy.test_and_set(memory_order_acquire); ++spins)
+        {
+            if (spins == MAX_PARITY_SPINS)
+            {
+                ++chn.ParitySkipped;
+                return;
+            }
+            this_thread::yield();
+        }
+
+        const size_t maxPayload = GetMaxPayload(chn);
+        const size_t covered = maxPayload < ParityEncoder::HEADER_SIZE ?
+            0 : maxPayload - ParityEncoder::HEADER_SIZE;
+        const double loss = chn.Policy.GetLoss();
+        using enum ParityEncoder::AddResult;
+        const ParityEncoder::AddResult added =
+            chn.Parity.Add(number, parts, loss, covered);
+        if (added != Pending) { SendParity(chn); }
+        if (added == Closed)
+        {
+            // It starts the next group.
+            (void)chn.Parity.Add(number, parts, loss, covered);
+        }
+        chn.ParityBusy.clear(memory_order_release);
+    }
+
+    // Hold ParityBusy.
+    static void SendParity(DatagramChannel &chn) noexcept
+    {
+        constexpr size_t capacity =
+            ParityEncoder::HEADER_SIZE + ParityEncoder::MAX_PAYLOAD;
+        RawBuffer *rawBuffer = AllocateBuffer(capacity);
+        if (rawBuffer == nullptr) [[unlikely]]
+        {
+            chn.Parity.Reset();
+            return;
+        }
+
+        uint32_t first;
+        const size_t size =
+            chn.Parity.TakeParity(span{rawBuffer->Data, capacity}, first);
+        if (size == 0) [[unlikely]]
+        {
+            FreeRawBuffer(rawBuffer);
+            return;
+        }
+        rawBuffer->PacketLengthOrNumber = htonl(PARITY_FLAG | first);
+        rawBuffer->Buffer.Buffer = rawBuffer->Data - 4;
+        rawBuffer->Buffer.Length = 4 + (uint32_t)size;
+        SendOnConnections(chn, rawBuffer, &rawBuffer->Buffer, 1);
+    }
+
+    // Release the reference held while sending.
+    static bool Finish(RawBuffer *rawBuffer, bool sent) noexcept
+    {
+        if (not sent) { rawBuffer->OnComplete = nullptr; }
+        ReleaseRawBuffer(rawBuffer);
+        return sent;
+    }
+
+    [[nodiscard]] static RawBuffer *AllocateBuffer(uint32_t datasize) noexcept
     {
-        const uint32_t datasize = (uint16_t)data.size();
         const uint32_t allocsize = sizeof(RawBuffer) + datasize;
-        uint8_t *allocated = new(nothrow) uint8_t[allocsize];
-        if (allocated == nullptr) { return nullopt; }
+        uint8_t *allocated =
+            (uint8_t *)GetSendBufferPool().Allocate(allocsize);
+        if (allocated == nullptr) { return nullptr; }
 
-        // Not only the real data, but we also send the packet number and the
-        // length of real data in addition (4 bytes).
         RawBuffer *rawBuffer = (RawBuffer *)allocated;
 
         // warning C6001: Using uninitialized memory '*allocated'.
@@ -291,12 +1442,72 @@ private:
         rawBuffer->RefCount = 0;
 #pragma warning(pop)
 
+        rawBuffer->OnComplete = nullptr;
+        rawBuffer->Context = nullptr;
+        return rawBuffer;
+    }
+
+    // The message must be in Data (or QUIC_BUFFERs there, and Length holds
+    // 4 + its size). At most MAX_RELIABLE_SIZE, so the varint fits the 4
+    // bytes before Data.
+    static void SetLengthPrefix(RawBuffer *rawBuffer, uint32_t size) noexcept
+    {
+        const size_t prefix = GetVarintSize(size);
+        uint8_t *header = rawBuffer->Data - prefix;
+        (void)EncodeVarint(size, span{header, prefix});
+        rawBuffer->Buffer.Buffer = header;
+        rawBuffer->Buffer.Length = (uint32_t)prefix + size;
+    }
+
+    static optional<RawBuffer *> MakeBuffer(span<const uint8_t> data) noexcept
+    {
+        const uint32_t datasize = (uint16_t)data.size();
+        RawBuffer *rawBuffer = AllocateBuffer(datasize);
+        if (rawBuffer == nullptr) { return nullopt; }
+
+        // Not only the real data, but we also send the packet number and the
+        // length of real data in addition (4 bytes).
         rawBuffer->Buffer.Buffer = rawBuffer->Data - 4;
         rawBuffer->Buffer.Length = 4 + datasize;
         memcpy(rawBuffer->Data, data.data(), datasize);
 
         return rawBuffer;
     }
+
+    // The header followed by the parts, referred to by QUIC_BUFFERs in Data.
+    // Buffer holds the header, and the total length for the accounting.
+    static optional<RawBuffer *> MakeGatherBuffer(
+        span<const span<const uint8_t>> parts,
+        size_t maxSize,
+        SendCompletion *onComplete,
+        void *context
+        ) noexcept
+    {
+        if (parts.size() > MAX_GATHER_PARTS) [[unlikely]] { return nullopt; }
+        if (onComplete == nullptr) [[unlikely]] { return nullopt; }
+
+        size_t size = 0;
+        for (span<const uint8_t> part : parts) { size += part.size(); }
+        if (size > maxSize) { return nullopt; }
+
+        const uint32_t count = (uint32_t)parts.size() + 1;
+        RawBuffer *rawBuffer = AllocateBuffer(count * sizeof(QUIC_BUFFER));
+        if (rawBuffer == nullptr) { return nullopt; }
+
+        rawBuffer->Buffer.Buffer = (uint8_t *)&rawBuffer->PacketLengthOrNumber;
+        rawBuffer->Buffer.Length = 4 + (uint32_t)size;
+        rawBuffer->OnComplete = onComplete;
+        rawBuffer->Context = context;
+
+        QUIC_BUFFER *buffers = (QUIC_BUFFER *)rawBuffer->Data;
+        buffers[0] = {4, rawBuffer->Buffer.Buffer};
+        for (uint32_t i = 1; i < count; ++i)
+        {
+            buffers[i].Length = (uint32_t)parts[i - 1].size();
+            buffers[i].Buffer = (uint8_t *)parts[i - 1].data();
+        }
+        return rawBuffer;
+    }
 };
 
 inline bool AutoReject(
@@ -312,17 +1523,39 @@ inline void NoOpReceive(
     [[maybe_unused]] void *channelContext
     ) noexcept {}
 
+// Called with the messages of a reliable channel instead of
+// Kontext::OnReliableReceive, if set for the channel.
+using DeferredReceiveCallback = void (
+    KoiChan channel,
+    ReceivedMessage message,
+    void *globalContext,
+    void *channelContext
+    ) noexcept;
+
+inline void NoOpWritable(
+    [[maybe_unused]] KoiChan channel,
+    [[maybe_unused]] uint32_t reliableChannel,
+    [[maybe_unused]] void *globalContext,
+    [[maybe_unused]] void *channelContext
+    ) noexcept {}
+
 inline void NoOpDisconnect(
     [[maybe_unused]] KoiChan channel,
     [[maybe_unused]] void *globalContext,
     [[maybe_unused]] void *channelContext
     ) noexcept {}
 
+// msquic sends the data of the streams with higher priority first.
+inline constexpr uint16_t LOW_STREAM_PRIORITY = 0;
+inline constexpr uint16_t DEFAULT_STREAM_PRIORITY = 0x7fff;
+inline constexpr uint16_t HIGH_STREAM_PRIORITY = 0xffff;
+
 // Application global context.
 struct Kontext
 {
     using AcceptCallback = decltype(AutoReject);
     using ReceiveCallback = decltype(NoOpReceive);
+    using WritableCallback = decltype(NoOpWritable);
     using DisconnectCallback = decltype(NoOpDisconnect);
 
     void               *GlobalContext = nullptr;
@@ -332,7 +1565,37 @@ struct Kontext
         &NoOpReceive, &NoOpReceive, &NoOpReceive, &NoOpReceive,
     };
     ReceiveCallback    *OnUnreliableReceive = &NoOpReceive;
+
+    // A datagram arriving after a newer one, e.g. reordered on the way. It
+    // is dropped by default, as it may be stale by now.
+    ReceiveCallback    *OnLateUnreliableReceive = &NoOpReceive;
+
+    WritableCallback   *OnWritable = &NoOpWritable;
     DisconnectCallback *OnDisconnect = &NoOpDisconnect;
+
+    // Deliver the messages of a reliable channel without copying them out
+    // of the buffers of msquic, which keeps them until every message of a
+    // receive is released. msquic indicates nothing more on that stream
+    // meanwhile, so hold them briefly, e.g. to parse a state transfer.
+    DeferredReceiveCallback *OnDeferredReceive[4] = {};
+
+    // Queue the messages received for KoiSession::Poll() instead of calling
+    // the receive callbacks on the threads of msquic, where a slow callback
+    // holds up the connection. If Poll() falls behind by
+    // KoiSession::receiveQueueSize messages, a datagram that doesn't fit is
+    // dropped, and a reliable message that doesn't fit resets the whole
+    // connection, so call it every frame. The other callbacks are still
+    // called at once.
+    bool                QueuedDelivery = false;
+
+    // Of the reliable channels, on both streams of every connection. E.g.
+    // give the inputs a high priority, so that a bulk transfer on another
+    // channel doesn't delay them.
+    uint16_t            StreamPriority[4] =
+    {
+        DEFAULT_STREAM_PRIORITY, DEFAULT_STREAM_PRIORITY,
+        DEFAULT_STREAM_PRIORITY, DEFAULT_STREAM_PRIORITY,
+    };
 };
 
 } // namespace ks3:: detail
@@ -57,12 +57,33 @@ _Function_class_(QUIC_STREAM_CALLBACK)
 inline QUIC_STATUS StreamCallback(
     HQUIC /* strm */ hndl, void *ctx, QUIC_STREAM_EVENT *ev) noexcept;
 
+// A message received in queued delivery (see Kontext::QueuedDelivery), with
+// a copy of its data or the lease of a deferred receive.
+struct QueuedMessage
+{
+    static constexpr uint8_t UNRELIABLE = 4;
+    static constexpr uint8_t LATE_UNRELIABLE = 5;
+
+    ConnectionContext *Connection = nullptr;
+    uint32_t Generation = 0; // of the connection when queued
+    uint8_t Kind = 0; // the reliable channel, or one of the kinds above
+    span<const uint8_t> Data;
+    uint8_t *Copy = nullptr; // from KoiSession::receivePool
+    ReceiveLease *Lease = nullptr;
+};
+
 class KoiSession
 {
 public:
 
+    // Peers and spectators share the connections. A host with many
+    // spectators should construct the session with a larger number.
+    constexpr static int defaultMaxConnections = 16;
+
+    // The messages Poll() can be behind by; see Kontext::QueuedDelivery.
+    constexpr static size_t receiveQueueSize = 4096;
+
 private:
-    constexpr static int maxConnections = 16;
     constexpr static seconds retryTimeout = 4s;
     constexpr static seconds longStopRetryTimeout = 60s;
     constexpr static seconds shortStopRetryTimeout = 12s;
@@ -73,18 +94,32 @@ private:
     mutex connCtxCreationMutex;
 
     Kontext appContext;
-    array<ConnectionContext, maxConnections> connectionContexts{};
+    unique_ptr<ConnectionContext[]> connectionStorage;
+    span<ConnectionContext> connectionContexts;
     SharedListener listener;
     NonOwningUdpSocket socketFromListener;
     UdpHandler sentinel;
 
+    // Only allocated for queued delivery. The copies come from the pool, so
+    // that the threads of msquic seldom allocate from the heap.
+    using ReceiveQueue = MpscRingQueue<QueuedMessage, receiveQueueSize>;
+    unique_ptr<ReceiveQueue> receiveQueue;
+    unique_ptr<BufferPool> receivePool;
+
     // loop to check all ongoing connections, and cancel if times out
     condition_variable stopSignal;
     mutex stopMutex;
     thread halfConnectionDaemon;
 
 public:
-    // defaulted construction
+    explicit KoiSession(int maxConnections = defaultMaxConnections) noexcept
+    {
+        if (maxConnections <= 0) [[unlikely]] { return; }
+        connectionStorage.reset(
+            new(nothrow) ConnectionContext[maxConnections]);
+        if (not connectionStorage) [[unlikely]] { return; }
+        connectionContexts = {connectionStorage.get(), (size_t)maxConnections};
+    }
 
     ~KoiSession() noexcept
     {
@@ -107,6 +142,16 @@ public:
                 lk.lock();
             }
         }
+
+        // The leases keep their streams open.
+        if (receiveQueue)
+        {
+            receiveQueue->Drain([&](QueuedMessage &message) noexcept
+            {
+                if (message.Copy) { receivePool->Free(message.Copy); }
+                if (message.Lease) { ReleaseReceiveLease(message.Lease); }
+            });
+        }
     }
 
     uint16_t GetSentinelPort() noexcept
@@ -122,11 +167,20 @@ public:
     {
         // startup failed
         if (msquic.InitError) [[unlikely]] { return nullopt; }
+        if (connectionContexts.empty()) [[unlikely]] { return nullopt; }
 
         // already started
         uint16_t alreadyStartedPort = GetSentinelPort();
         if (alreadyStartedPort) { return alreadyStartedPort; }
 
+        if (kontext.QueuedDelivery and not receiveQueue)
+        {
+            receivePool.reset(new(nothrow) BufferPool);
+            if (not receivePool) [[unlikely]] { return nullopt; }
+            receiveQueue.reset(new(nothrow) ReceiveQueue);
+            if (not receiveQueue) [[unlikely]] { return nullopt; }
+        }
+
         // try to bind a specific or unspecific port
         auto maybeHandler = UdpHandler::Bind(port);
         if (not maybeHandler) { return nullopt; }
@@ -169,6 +223,56 @@ public:
         return sentinel.GetPort();
     }
 
+    // Call the receive callbacks for the messages queued since the last call,
+    // at most `limit` of them, on this thread; see Kontext::QueuedDelivery.
+    // Call it once per frame, from one thread at a time.
+    //
+    // Return the number of messages taken from the queue.
+    size_t Poll(size_t limit = receiveQueueSize) noexcept
+    {
+        if (not receiveQueue) { return 0; }
+
+        // The messages of a connection tend to come in a row, so we lock its
+        // context once for them. Those queued before the context was reset
+        // belong to the previous peer. The user has dropped the channel
+        // context once only we and the connection hold it; see
+        // ConnectionContext::GetChannelContext.
+        ConnectionContext *connCtx = nullptr;
+        uint32_t generation = 0;
+        shared_ptr<void> channelCtx;
+        return receiveQueue->Drain([&](QueuedMessage &message) noexcept
+        {
+            if (message.Connection != connCtx or
+                message.Generation != generation)
+            {
+                connCtx = message.Connection;
+                generation = message.Generation;
+                channelCtx = connCtx->ChannelContext.lock();
+            }
+            if (channelCtx.use_count() <= 2 or
+                generation != connCtx->Generation)
+            {
+                if (message.Lease) { ReleaseReceiveLease(message.Lease); }
+            }
+            else if (message.Lease)
+            {
+                appContext.OnDeferredReceive[message.Kind](
+                    CreateChannel(*connCtx),
+                    ReceivedMessage{message.Data, message.Lease},
+                    appContext.GlobalContext,
+                    channelCtx.get());
+            }
+            else
+            {
+                CallReceive(*connCtx, message.Kind, message.Data,
+                    channelCtx.get());
+            }
+            if (message.Copy) { receivePool->Free(message.Copy); }
+            message.Copy = nullptr;
+            message.Lease = nullptr;
+        }, limit);
+    }
+
     // Try to establish a connection. Will do this thing:
     // 0. bind a UDP port for a sentinel to handle raw UDP packet.
     // 1. bind a UDP port for a local client.
@@ -303,7 +407,7 @@ private:
             appContext.OnDisconnect(
                 CreateChannel(connCtx),
                 appContext.GlobalContext,
-                connCtx.ChannelContext.lock().get());
+                connCtx.GetChannelContext());
             return;
         }
 
@@ -324,7 +428,7 @@ private:
     pair<bool, int> FindMatchingEntry(const QUIC_ADDR &remote) noexcept
     {
         int firstEmpty = -1;
-        for (int i = 0; i < connectionContexts.size(); ++i)
+        for (int i = 0; i < (int)connectionContexts.size(); ++i)
         {
             auto &connCtx = connectionContexts[i];
             if (not connCtx.ModifyMutex.try_lock()) { continue; }
@@ -555,9 +659,10 @@ private:
                 conn.get(),
                 QUIC_STREAM_OPEN_FLAG_NONE,
                 StreamCallback,
-                &ctx);
+                &ctx.Reliable[i].Contexts[0]);
             if (not maybeStream) { continue; }
 
+            SetStreamPriority(maybeStream->get(), i);
             ctx.Reliable[i].Self = move(*maybeStream);
         }
         connCtxLock.unlock();
@@ -573,6 +678,8 @@ private:
             ctx.Reset();
             return;
         }
+        ctx.StrongChannelContext = ctx.ChannelContext.lock();
+        ctx.AcceptedGeneration = ctx.Generation;
         // Now we can start this connection.
 
         // Close the client socket and start quic connection on the same port.
@@ -609,11 +716,98 @@ private:
         }
     }
 
+    void SetStreamPriority(HQUIC strm, int channel) const noexcept
+    {
+        const uint16_t priority = appContext.StreamPriority[channel];
+        if (priority == DEFAULT_STREAM_PRIORITY) { return; }
+        MsQuic->SetParam(strm, QUIC_PARAM_STREAM_PRIORITY,
+            sizeof(priority), &priority);
+    }
+
     static KoiChan CreateChannel(ConnectionContext &ctx) noexcept
     {
         return KoiChan{ctx};
     }
 
+    void CallReceive(
+        ConnectionContext &ctx,
+        uint8_t kind,
+        span<const uint8_t> data,
+        void *channelCtx
+        ) const noexcept
+    {
+        Kontext::ReceiveCallback *callback =
+            kind == QueuedMessage::UNRELIABLE ?
+                appContext.OnUnreliableReceive :
+            kind == QueuedMessage::LATE_UNRELIABLE ?
+                appContext.OnLateUnreliableReceive :
+            appContext.OnReliableReceive[kind];
+        callback(CreateChannel(ctx), data, appContext.GlobalContext,
+            channelCtx);
+    }
+
+    // Call the receive callback of the kind now, or queue a copy of the
+    // message for Poll(). Return false if the queue is full or we are out of
+    // memory.
+    bool Receive(
+        ConnectionContext &ctx,
+        uint8_t kind,
+        span<const uint8_t> data,
+        void *channelCtx
+        ) noexcept
+    {
+        if (not receiveQueue)
+        {
+            CallReceive(ctx, kind, data, channelCtx);
+            return true;
+        }
+        return receiveQueue->TryProduce([&](QueuedMessage &message) noexcept
+        {
+            message.Copy = (uint8_t *)receivePool->Allocate(data.size());
+            if (message.Copy == nullptr) [[unlikely]] { return false; }
+            memcpy(message.Copy, data.data(), data.size());
+            message.Connection = &ctx;
+            message.Generation = ctx.Generation;
+            message.Kind = kind;
+            message.Data = {message.Copy, data.size()};
+            message.Lease = nullptr;
+            return true;
+        });
+    }
+
+    // The same for a message delivered in place, which keeps its lease in
+    // the queue. The message is released if it can't be queued.
+    bool ReceiveDeferred(
+        ConnectionContext &ctx,
+        int channel,
+        ReceivedMessage received,
+        void *channelCtx
+        ) noexcept
+    {
+        if (not receiveQueue)
+        {
+            appContext.OnDeferredReceive[channel](
+                CreateChannel(ctx),
+                received,
+                appContext.GlobalContext,
+                channelCtx);
+            return true;
+        }
+        const bool queued = receiveQueue->TryProduce(
+            [&](QueuedMessage &message) noexcept
+            {
+                message.Connection = &ctx;
+                message.Generation = ctx.Generation;
+                message.Kind = (uint8_t)channel;
+                message.Data = received.Data;
+                message.Copy = nullptr;
+                message.Lease = received.Lease;
+                return true;
+            });
+        if (not queued) { received.Release(); }
+        return queued;
+    }
+
     friend inline QUIC_STATUS ListenerCallback(
         HQUIC /* lisn */ hndl, void *ctx, QUIC_LISTENER_EVENT *ev) noexcept;
     friend inline QUIC_STATUS ConnectionCallback(
@@ -644,6 +838,7 @@ private:
     friend STREAM_HANDLER(QUIC_STREAM_EVENT_START_COMPLETE);
     friend STREAM_HANDLER(QUIC_STREAM_EVENT_RECEIVE);
     friend STREAM_HANDLER(QUIC_STREAM_EVENT_SEND_COMPLETE);
+    friend void NotifyWritable(ConnectionContext &, int) noexcept;
     friend STREAM_HANDLER(QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN);
     friend STREAM_HANDLER(QUIC_STREAM_EVENT_PEER_SEND_ABORTED);
     friend STREAM_HANDLER(QUIC_STREAM_EVENT_PEER_RECEIVE_ABORTED);
@@ -778,7 +973,7 @@ CONNECTION_HANDLER(QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE)
         sess.appContext.OnDisconnect(
             sess.CreateChannel(connCtx),
             sess.appContext.GlobalContext,
-            connCtx.ChannelContext.lock().get());
+            connCtx.GetChannelContext());
         connCtx.Reset();
     }
 
@@ -815,8 +1010,17 @@ CONNECTION_HANDLER(QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED)
     uint32_t len = sizeof(streamIndex);
     MsQuic->GetParam(strm, QUIC_PARAM_STREAM_ID, &len, &streamIndex);
 
-    connCtx.Reliable[streamIndex >> 2].Peer = SharedStream{strm};
-    MsQuic->SetCallbackHandler(strm, (void *)StreamCallback, &connCtx);
+    const int index = (int)(streamIndex >> 2);
+    if (index >= 4) [[unlikely]]
+    {
+        MsQuic->StreamClose(strm);
+        return QUIC_STATUS_SUCCESS;
+    }
+
+    StreamChannel &chn = connCtx.Reliable[index];
+    chn.Peer = SharedStream{strm};
+    MsQuic->SetCallbackHandler(strm, (void *)StreamCallback, &chn.Contexts[1]);
+    connCtx.pSession->SetStreamPriority(strm, index);
 
     return QUIC_STATUS_SUCCESS;
 }
@@ -853,43 +1057,102 @@ CONNECTION_HANDLER(QUIC_CONNECTION_EVENT_DATAGRAM_RECEIVED)
     ConnectionContext &connCtx = *(ConnectionContext *)ctx;
     KoiSession &sess = *connCtx.pSession;
 
-    // If user delete the app context, we drop connection immediately.
-    shared_ptr<void> channelCtx = connCtx.ChannelContext.lock();
-    if (not channelCtx)
+    // If user delete the app context, we drop connection immediately. Poll()
+    // locks it for the queued messages.
+    void *channelCtx = connCtx.GetChannelContext();
+    if (channelCtx == nullptr)
     {
         connCtx.Reset();
         return QUIC_STATUS_ABORTED;
     }
 
     const QUIC_BUFFER *buf = ev->DATAGRAM_RECEIVED.Buffer;
+    if (buf->Length < 4) [[unlikely]] { return QUIC_STATUS_SUCCESS; }
     span<const uint8_t> data{buf->Buffer + 4, buf->Length - 4};
 
     uint32_t packetNumber;
     memcpy(&packetNumber, buf->Buffer, sizeof(packetNumber));
     packetNumber = ntohl(packetNumber);
 
-    lock_guard recvLock{connCtx.Unreliable.RecvMutex};
-    if (connCtx.Unreliable.NextRecvPacket == packetNumber)
+    DatagramChannel &chn = connCtx.Unreliable;
+    lock_guard recvLock{chn.RecvMutex};
+
+    // We remember the datagrams from the first parity on.
+    array<uint8_t, ParityDecoder::MAX_PAYLOAD> rebuilt;
+    if ((packetNumber & (PARITY_FLAG | FRAGMENT_FLAG)) == FRAGMENT_FLAG)
     {
-        ++connCtx.Unreliable.NextRecvPacket;
-        sess.appContext.OnUnreliableReceive(
-            sess.CreateChannel(connCtx),
-            data,
-            sess.appContext.GlobalContext,
-            channelCtx.get());
+        if (data.size() < 2) [[unlikely]] { return QUIC_STATUS_SUCCESS; }
+        const FragmentHeader header = FragmentHeader::Decode(
+            packetNumber, (uint16_t)(data[0] << 8 | data[1]));
+        optional message = chn.Fragments.OnFragment(
+            header, data.subspan(2), steady_clock::now());
+        if (not message) { return QUIC_STATUS_SUCCESS; }
+        data = *message;
     }
+    else if (packetNumber & PARITY_FLAG)
+    {
+        if (not chn.Recovery)
+        {
+            chn.Recovery.reset(new(nothrow) ParityDecoder);
+            return QUIC_STATUS_SUCCESS;
+        }
+        optional size = chn.Recovery->OnParity(
+            packetNumber & PACKET_NUMBER_MASK, data, rebuilt, packetNumber);
+        if (not size) { return QUIC_STATUS_SUCCESS; }
+
+        // It was lost, so we pass it even if it is old, unless the other
+        // connection has delivered it meanwhile.
+        data = span{rebuilt.data(), *size};
+        using enum PacketWindow::Arrival;
+        const PacketWindow::Arrival arrival = chn.Window.OnPacket(packetNumber);
+        if (arrival == Duplicate) { return QUIC_STATUS_SUCCESS; }
+    }
+    else
+    {
+        if (chn.Recovery) { chn.Recovery->OnData(packetNumber, data); }
+
+        // Pass the packets newer than every one received: waiting for a
+        // lost packet would stall the channel forever. Those reordered go
+        // to OnLateUnreliableReceive, and those received already nowhere.
+        using enum PacketWindow::Arrival;
+        const PacketWindow::Arrival arrival = chn.Window.OnPacket(packetNumber);
+        if (arrival == Late)
+        {
+            // A datagram may be dropped, so a full queue is no error.
+            (void)sess.Receive(connCtx, QueuedMessage::LATE_UNRELIABLE,
+                data, channelCtx);
+        }
+        if (arrival != Newest) { return QUIC_STATUS_SUCCESS; }
+    }
+
+    (void)sess.Receive(connCtx, QueuedMessage::UNRELIABLE,
+        data, channelCtx);
 
     return QUIC_STATUS_SUCCESS;
 }
 
 CONNECTION_HANDLER(QUIC_CONNECTION_EVENT_DATAGRAM_SEND_STATE_CHANGED)
 {
-    // Fire and forget
-    if (ev->DATAGRAM_SEND_STATE_CHANGED.State == QUIC_DATAGRAM_SEND_SENT)
+    // Fire and forget. A datagram is either sent or canceled before send,
+    // and msquic no longer uses the buffer after that.
+    const QUIC_DATAGRAM_SEND_STATE state =
+        ev->DATAGRAM_SEND_STATE_CHANGED.State;
+    if (state == QUIC_DATAGRAM_SEND_SENT or
+        state == QUIC_DATAGRAM_SEND_CANCELED)
     {
         RawBuffer *buf =
             (RawBuffer *)ev->DATAGRAM_SEND_STATE_CHANGED.ClientContext;
-        if (--buf->RefCount == 0) { delete[] buf; }
+        ReleaseRawBuffer(buf);
+    }
+
+    // The buffer is gone by now; we only learn that the connection works.
+    if (state == QUIC_DATAGRAM_SEND_ACKNOWLEDGED or
+        state == QUIC_DATAGRAM_SEND_ACKNOWLEDGED_SPURIOUS)
+    {
+        ConnectionContext &connCtx = *(ConnectionContext *)ctx;
+        DatagramChannel &chn = connCtx.Unreliable;
+        chn.Policy.OnAcknowledged(conn == chn.Self.get() ?
+            PathPolicy::SELF : PathPolicy::PEER);
     }
     return QUIC_STATUS_SUCCESS;
 }
@@ -962,12 +1225,14 @@ STREAM_HANDLER(QUIC_STREAM_EVENT_START_COMPLETE)
 
 STREAM_HANDLER(QUIC_STREAM_EVENT_RECEIVE)
 {
-    ConnectionContext &connCtx = *(ConnectionContext *)ctx;
+    const StreamContext &strmCtx = *(StreamContext *)ctx;
+    ConnectionContext &connCtx = *strmCtx.Connection;
     KoiSession &sess = *connCtx.pSession;
 
-    // If user delete the app context, we drop connection immediately.
-    shared_ptr<void> channelCtx = connCtx.ChannelContext.lock();
-    if (not channelCtx)
+    // If user delete the app context, we drop connection immediately. Poll()
+    // locks it for the queued messages.
+    void *channelCtx = connCtx.GetChannelContext();
+    if (channelCtx == nullptr)
     {
         connCtx.Reset();
         return QUIC_STATUS_ABORTED;
@@ -981,22 +1246,61 @@ STREAM_HANDLER(QUIC_STREAM_EVENT_RECEIVE)
     const uint32_t bufCount = ev->RECEIVE.BufferCount;
     uint64_t nowoff = absoff;
 
-    // The least significant bit (0x1): client 0 / server 1
-    // The second least significant bit (0x2): bidi 0 / unidi 1
-    QUIC_UINT62 id;
-    uint32_t size = sizeof(id);
-    MsQuic->GetParam(strm, QUIC_PARAM_STREAM_ID, &size, &id);
-    int index = (int)(id >> 2);
-
+    const int index = strmCtx.Index;
     StreamChannel &chn = connCtx.Reliable[index];
-    vector<uint8_t> &vec = chn.Buffer;
+    DeferredReceiveCallback *deferred =
+        sess.appContext.OnDeferredReceive[index];
 
-    lock_guard recvLock{chn.RecvMutex};
+    unique_lock recvLock{chn.RecvMutex};
     uint64_t desiredByte = chn.NextRecvByte;
 
     // We received newer data from another stream.
     if (absoff + length <= desiredByte) { return QUIC_STATUS_CONTINUE; }
 
+    // Of the messages delivered in place, if deferred.
+    ReceiveLease *lease = nullptr;
+    bool failed = false; // out of memory, or the queue is full
+    auto deliverDeferred = [&](span<const uint8_t> data) noexcept
+    {
+        ReceiveLease *owner;
+        if (chn.Parser.IsBuffered(data))
+        {
+            owner = new(nothrow) ReceiveLease{};
+            if (owner != nullptr) { owner->Copy = chn.Parser.TakeBuffer(); }
+        }
+        else
+        {
+            if (lease == nullptr)
+            {
+                lease = new(nothrow) ReceiveLease{
+                    .Channel = &chn, .Stream = strm, .Length = length};
+            }
+            owner = lease;
+            if (owner != nullptr) { ++owner->RefCount; }
+        }
+        if (owner == nullptr) [[unlikely]]
+        {
+            failed = true;
+            return;
+        }
+        failed = not sess.ReceiveDeferred(
+            connCtx, index, ReceivedMessage{data, owner}, channelCtx);
+    };
+
+    // Keep the buffers if the app still holds a message in them.
+    auto finish = [&]() noexcept -> QUIC_STATUS
+    {
+        if (lease == nullptr) { return QUIC_STATUS_CONTINUE; }
+        AddPendingReceive(lease);
+        if (--lease->RefCount != 0) { return QUIC_STATUS_PENDING; }
+        {
+            lock_guard _{chn.PendingMutex};
+            RemovePendingReceive(lease);
+        }
+        delete lease;
+        return QUIC_STATUS_CONTINUE;
+    };
+
     // Locate and read the desired byte.
     for (uint32_t i = 0; i < bufCount; ++i)
     {
@@ -1008,46 +1312,74 @@ STREAM_HANDLER(QUIC_STREAM_EVENT_RECEIVE)
         // the data have been corrupt.
         if (desiredByte < bufBeginOffset)
         {
+            recvLock.unlock();
             connCtx.Reset();
-            return QUIC_STATUS_ABORTED;
+            return lease ? finish() : QUIC_STATUS_ABORTED;
         }
 
         // bufBeginOffset < bufEndOffset <= desiredByte: skip
         if (bufEndOffset <= desiredByte) { continue; }
 
         // bufBeginOffset <= desiredByte < bufEndOffset: read
-        uint8_t *readBegin = bufs[i].Buffer + (desiredByte - bufBeginOffset);
-        uint8_t *readEnd   = bufs[i].Buffer + bufs[i].Length;
-
-        vec.insert(vec.end(), readBegin, readEnd);
+        span<const uint8_t> bytes{
+            bufs[i].Buffer + (desiredByte - bufBeginOffset),
+            bufs[i].Buffer + bufs[i].Length};
         desiredByte = chn.NextRecvByte = bufEndOffset;
 
-        // Try to call user callback.
-        uint32_t msglen;
-        while (vec.size() >= 4)
-        {
-            memcpy(&msglen, vec.data(), 4);
-            msglen = ntohl(msglen);
-            if (vec.size() >= msglen + 4)
+        // Call the user callback for every message completed.
+        const bool parsed = chn.Parser.Parse(bytes,
+            [&](span<const uint8_t> data) noexcept
             {
-                span<uint8_t> data{vec.data() + 4, msglen};
-                sess.appContext.OnReliableReceive[index](
-                    sess.CreateChannel(connCtx),
-                    data,
-                    sess.appContext.GlobalContext,
-                    channelCtx.get());
-                vec.erase(vec.begin(), vec.begin() + 4 + msglen);
-            }
+                if (failed) [[unlikely]] { return; }
+                if (deferred != nullptr)
+                {
+                    deliverDeferred(data);
+                    return;
+                }
+                failed = not sess.Receive(
+                    connCtx, (uint8_t)index, data, channelCtx);
+            });
+        if (not parsed or failed)
+        {
+            recvLock.unlock();
+            connCtx.Reset();
+            return lease ? finish() : QUIC_STATUS_ABORTED;
         }
     }
 
-    return QUIC_STATUS_CONTINUE;
+    return finish();
+}
+
+// Call OnWritable if a send on the channel would have blocked, and the
+// bytes in flight are below the budget now.
+inline void NotifyWritable(ConnectionContext &connCtx, int index) noexcept
+{
+    StreamChannel &chn = connCtx.Reliable[index];
+    if (not chn.Blocked) { return; }
+    if (chn.SendingBytes >= chn.GetSendBudget()) { return; }
+    if (not chn.Blocked.exchange(false)) { return; }
+
+    void *channelCtx = connCtx.GetChannelContext();
+    if (channelCtx == nullptr) { return; }
+    KoiSession &sess = *connCtx.pSession;
+    sess.appContext.OnWritable(
+        sess.CreateChannel(connCtx),
+        (uint32_t)index,
+        sess.appContext.GlobalContext,
+        channelCtx);
 }
 
 STREAM_HANDLER(QUIC_STREAM_EVENT_SEND_COMPLETE)
 {
+    const StreamContext &strmCtx = *(StreamContext *)ctx;
+    ConnectionContext &connCtx = *strmCtx.Connection;
     RawBuffer *buf = (RawBuffer *)ev->SEND_COMPLETE.ClientContext;
-    if (--buf->RefCount == 0) { delete[] buf; }
+    const int index = strmCtx.Index;
+
+    connCtx.SendingBytes -= buf->Buffer.Length;
+    connCtx.Reliable[index].SendingBytes -= buf->Buffer.Length;
+    ReleaseRawBuffer(buf);
+    NotifyWritable(connCtx, index);
 
     return QUIC_STATUS_SUCCESS;
 }
@@ -1073,7 +1405,14 @@ STREAM_HANDLER(QUIC_STREAM_EVENT_PEER_RECEIVE_ABORTED)
 
 STREAM_HANDLER(QUIC_STREAM_EVENT_SEND_SHUTDOWN_COMPLETE)
 {
-    MsQuic->StreamClose(strm);
+    const StreamContext &strmCtx = *(StreamContext *)ctx;
+    ConnectionContext &connCtx = *strmCtx.Connection;
+
+    // A message delivered in place may still point into its buffers.
+    if (ClosePendingStream(connCtx.Reliable[strmCtx.Index], strm))
+    {
+        MsQuic->StreamClose(strm);
+    }
     return QUIC_STATUS_SUCCESS;
 }
 
@@ -1085,7 +1424,14 @@ STREAM_HANDLER(QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE)
 
 STREAM_HANDLER(QUIC_STREAM_EVENT_IDEAL_SEND_BUFFER_SIZE)
 {
-    // We don't use async send API and will not receive this event.
+    const StreamContext &strmCtx = *(StreamContext *)ctx;
+    ConnectionContext &connCtx = *strmCtx.Connection;
+
+    StreamChannel &chn = connCtx.Reliable[strmCtx.Index];
+    chn.IdealSendBytes[strmCtx.Direction] =
+        ev->IDEAL_SEND_BUFFER_SIZE.ByteCount;
+    NotifyWritable(connCtx, strmCtx.Index);
+
     return QUIC_STATUS_SUCCESS;
 }
 
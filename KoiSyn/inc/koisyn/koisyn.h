@@ -4,6 +4,12 @@
 #include "koisession.h"
 #include "checksum.h"
 #include "rpng.h"
+#include "ring_queue.h"
+#include "predictor.h"
+#include "time_sync.h"
+#include "redundancy.h"
+#include "speculation.h"
+#include "varint.h"
 
 namespace ks3::detail
 {
@@ -66,22 +72,1762 @@ concept ConceptGameState =
         { a.Over() } noexcept -> same_as<bool>;
     };
 
+// Optional tuning knobs of the game state. If the state doesn't provide them,
+// the defaults are used.
+//
+// MAX_ROLLBACK_FRAME: how many frames we can run ahead of the last frame that
+// every player's input is confirmed. Beyond that, the engine stalls.
+// MAX_DYNAMIC_INPUT_SIZE: the capacity of the dynamic part of an input. The
+// storage is preallocated, so we don't allocate when receiving inputs.
+// MAX_DESYNC_CHECK_INTERVAL: the upper bound of the desync check interval,
+// which decides how much history we keep to find the first diverging frame.
+template <typename State>
+consteval int GetMaxRollbackFrame() noexcept
+{
+    if constexpr (requires { int{State::MAX_ROLLBACK_FRAME}; })
+    {
+        return State::MAX_ROLLBACK_FRAME;
+    }
+    else { return 8; }
+}
+
+template <typename State>
+consteval int GetMaxDynamicInputSize() noexcept
+{
+    if constexpr (requires { int{State::MAX_DYNAMIC_INPUT_SIZE}; })
+    {
+        return State::MAX_DYNAMIC_INPUT_SIZE;
+    }
+    else { return 256; }
+}
+
+template <typename State>
+consteval int GetMaxDesyncCheckInterval() noexcept
+{
+    if constexpr (requires { int{State::MAX_DESYNC_CHECK_INTERVAL}; })
+    {
+        return State::MAX_DESYNC_CHECK_INTERVAL;
+    }
+    else { return 32; }
+}
+
+template <int FixedSize, bool DynamicSize>
+[[nodiscard]] bool InputEquals(
+    const InputData<FixedSize, DynamicSize> &a,
+    const InputData<FixedSize, DynamicSize> &b
+    ) noexcept
+{
+    if constexpr (FixedSize > 0)
+    {
+        if (a.fixed != b.fixed) { return false; }
+    }
+    if constexpr (DynamicSize)
+    {
+        if (a.dyn.size() != b.dyn.size()) { return false; }
+        if (a.dyn.empty()) { return true; }
+        return memcmp(a.dyn.data(), b.dyn.data(), a.dyn.size()) == 0;
+    }
+    return true;
+}
+
+// An input saved in the input ring. The dynamic part of the input refers to
+// the storage inside this slot, so we can't copy a slot by value; use Assign
+// instead.
+template <typename Input, int MaxDynamicSize>
+struct InputSlot
+{
+    int32_t Frame = -1;
+    bool Confirmed = false;
+    Input Data{};
+    array<uint8_t, Input::DYNAMIC_SIZE ? MaxDynamicSize : 0> DynStorage;
+
+    InputSlot() noexcept = default;
+    InputSlot(const InputSlot &) = delete;
+    void operator=(const InputSlot &) = delete;
+
+    // Return false if the dynamic part is too large to save.
+    bool Assign(const Input &input) noexcept
+    {
+        if constexpr (Input::FIXED_SIZE > 0)
+        {
+            Data.fixed = input.fixed;
+        }
+        if constexpr (Input::DYNAMIC_SIZE)
+        {
+            const size_t size = input.dyn.size();
+            if (size > DynStorage.size()) [[unlikely]] { return false; }
+
+            // Source and destination may be the same slot.
+            if (size != 0 and input.dyn.data() != DynStorage.data())
+            {
+                memmove(DynStorage.data(), input.dyn.data(), size);
+            }
+            Data.dyn = span<uint8_t>{DynStorage.data(), size};
+        }
+        return true;
+    }
+
+    void Clear() noexcept
+    {
+        Data = {};
+        if constexpr (Input::DYNAMIC_SIZE)
+        {
+            Data.dyn = span<uint8_t>{DynStorage.data(), 0};
+        }
+    }
+};
+
+// Where the game states of two peers diverge. The state at the beginning of
+// FirstFrame may already differ, and the state at the beginning of LastFrame
+// does. If we have found the exact frame, they are the same.
+struct DesyncReport
+{
+    int Player;
+    int32_t FirstFrame;
+    int32_t LastFrame;
+    uint64_t LocalChecksum;
+    uint64_t RemoteChecksum;
+};
+
+struct KoiSynStats
+{
+    uint64_t Predictions = 0; // predicted inputs checked against the real ones
+    uint64_t Mispredictions = 0;
+    uint64_t Rollbacks = 0;
+    uint64_t ResimulatedFrames = 0;
+    uint64_t Stalls = 0;
+    int32_t MaxRollbackDepth = 0;
+    uint64_t DesyncChecks = 0; // checksums compared with a remote
+    uint64_t DroppedSpectators = 0; // disconnected; see AddSpectator
+    uint64_t SpeculativeBranches = 0; // simulated by the workers
+    uint64_t SpeculationHits = 0; // mispredictions fixed by a branch
+    uint64_t SpeculationMisses = 0; // mispredictions rolled back anyway
+    uint64_t RedundantInputs = 0; // sent again in case of loss
+};
+
+// A received packet waiting in the input queue. It is large enough to hold
+// any datagram. We record when it is received for time synchronization.
+struct InputPacket
+{
+    static constexpr size_t CAPACITY = 1232;
+
+    uint16_t Size = 0;
+    steady_clock::time_point ReceivedAt;
+    array<uint8_t, CAPACITY> Data;
+
+    span<const uint8_t> Get() const noexcept
+    {
+        return span{Data.data(), Size};
+    }
+};
+
+// Inputs are received on msquic worker threads (both the client and the server
+// connection of a peer, so there are multiple producers) and consumed by the
+// game thread once per frame.
+using InputQueueType = MpscRingQueue<InputPacket, 128>;
+
+inline void StoreU32BE(uint8_t *out, uint32_t value) noexcept
+{
+    const uint32_t be = htonl(value);
+    memcpy(out, &be, 4);
+}
+
+[[nodiscard]] inline uint32_t LoadU32BE(const uint8_t *in) noexcept
+{
+    uint32_t be;
+    memcpy(&be, in, 4);
+    return ntohl(be);
+}
+
+inline void StoreU64BE(uint8_t *out, uint64_t value) noexcept
+{
+    const uint32_t hi = htonl((uint32_t)(value >> 32));
+    const uint32_t lo = htonl((uint32_t)value);
+    memcpy(out, &hi, 4);
+    memcpy(out + 4, &lo, 4);
+}
+
+[[nodiscard]] inline uint64_t LoadU64BE(const uint8_t *in) noexcept
+{
+    uint32_t hi;
+    uint32_t lo;
+    memcpy(&hi, in, 4);
+    memcpy(&lo, in + 4, 4);
+    return (uint64_t)ntohl(hi) << 32 | ntohl(lo);
+}
+
+// The header of an input packet. Besides the frames carried, it tells the
+// destination how its own inputs are received: every input of the
+// destination before or at Ack (-1 if unknown), and the loss rate of the
+// input packets from it, in 1/256.
+struct InputHeader
+{
+    int Player = 0;
+    int32_t Ack = -1;
+    uint8_t Loss = 0;
+    int32_t FirstFrame = 0;
+    int32_t Count = 0;
+};
+
+// Compact wire format of the inputs of a player in consecutive frames:
+// [type: 1 byte] [player: 1 byte] [ack + 1: varint] [loss: 1 byte]
+// [first frame: varint] [count: varint] followed by tokens (varints). See
+// KoiSynPacket for type.
+//
+// Every frame is XORed with the previous one (the first one with zeros), and
+// inputs seldom change between frames, so most of the deltas are zero:
+// - An even token 2n: the next n frames repeat the previous input, and have
+//   no dynamic part.
+// - An odd token: one frame follows. [mask: a bit per byte of the fixed
+//   part, set if the byte changes] [the XORed bytes that change] and, if the
+//   input has a dynamic part, [size: varint] [dynamic part].
+//
+// A run of changing inputs is no smaller than the raw bytes, and the header
+// is not fixed: one frame in which every byte changes takes
+// 5 + varints(ack + 1, first frame) + MASK_SIZE + FIXED_SIZE bytes, plus the
+// dynamic part: 16 bytes for a 4-byte input once the ack and the frame pass
+// 16383.
+template <typename Input>
+struct InputCodec
+{
+    static constexpr size_t FIXED_SIZE = Input::FIXED_SIZE;
+    static constexpr size_t MASK_SIZE = (FIXED_SIZE + 7) / 8;
+
+    using Fixed = array<uint8_t, FIXED_SIZE>;
+
+    // Encode header.Count frames from header.FirstFrame; getInput(i) returns
+    // the input of the i-th frame. Return the size written.
+    template <typename GetInput>
+    [[nodiscard]] static optional<size_t> Encode(
+        const InputHeader &header,
+        GetInput &&getInput,
+        span<uint8_t> out
+        ) noexcept
+    {
+        const int count = header.Count;
+        if (out.size() < 2 or count <= 0) [[unlikely]] { return nullopt; }
+        if (header.FirstFrame < 0 or header.Ack < -1) [[unlikely]]
+        {
+            return nullopt;
+        }
+        out[0] = (uint8_t)KoiSynPacket::Input;
+        out[1] = (uint8_t)header.Player;
+        size_t size = 2;
+        if (not Put(out, size, (uint32_t)(header.Ack + 1))) { return nullopt; }
+        if (size == out.size()) [[unlikely]] { return nullopt; }
+        out[size++] = header.Loss;
+        if (not Put(out, size, (uint32_t)header.FirstFrame)) { return nullopt; }
+        if (not Put(out, size, (uint32_t)count)) { return nullopt; }
+
+        Fixed previous{};
+        int repeats = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const Input &input = getInput(i);
+            Fixed current{};
+            if constexpr (FIXED_SIZE > 0) { current = input.fixed; }
+
+            bool repeated = current == previous;
+            if constexpr (Input::DYNAMIC_SIZE)
+            {
+                repeated = repeated and input.dyn.empty();
+            }
+            if (repeated)
+            {
+                ++repeats;
+                continue;
+            }
+
+            if (not PutRepeats(out, size, repeats)) { return nullopt; }
+            repeats = 0;
+            if (not Put(out, size, 1)) { return nullopt; }
+
+            if (out.size() - size < MASK_SIZE + FIXED_SIZE) [[unlikely]]
+            {
+                return nullopt;
+            }
+            uint8_t *mask = &out[size];
+            memset(mask, 0, MASK_SIZE);
+            size += MASK_SIZE;
+            for (size_t b = 0; b < FIXED_SIZE; ++b)
+            {
+                const uint8_t delta = current[b] ^ previous[b];
+                if (delta == 0) { continue; }
+                mask[b / 8] |= (uint8_t)(1 << (b % 8));
+                out[size++] = delta;
+            }
+            previous = current;
+
+            if constexpr (Input::DYNAMIC_SIZE)
+            {
+                const size_t dynSize = input.dyn.size();
+                if (not Put(out, size, dynSize)) { return nullopt; }
+                if (out.size() - size < dynSize) [[unlikely]]
+                {
+                    return nullopt;
+                }
+                if (dynSize != 0)
+                {
+                    memcpy(&out[size], input.dyn.data(), dynSize);
+                }
+                size += dynSize;
+            }
+        }
+        if (not PutRepeats(out, size, repeats)) { return nullopt; }
+        return size;
+    }
+
+    // Read the header, and call onInput(frame, input) for every frame in the
+    // packet. The dynamic part of the input refers to the packet.
+    template <typename OnInput>
+    [[nodiscard]] static bool Decode(
+        span<const uint8_t> packet,
+        InputHeader &header,
+        OnInput &&onInput
+        ) noexcept
+    {
+        if (packet.size() < 2) [[unlikely]] { return false; }
+        if (packet[0] != (uint8_t)KoiSynPacket::Input) { return false; }
+        header.Player = packet[1];
+
+        size_t offset = 2;
+        uint64_t ack;
+        uint64_t firstFrame;
+        uint64_t count;
+        if (not Get(packet, offset, ack)) { return false; }
+        if (offset == packet.size()) [[unlikely]] { return false; }
+        header.Loss = packet[offset++];
+        if (not Get(packet, offset, firstFrame)) { return false; }
+        if (not Get(packet, offset, count)) { return false; }
+        if (ack > INT32_MAX or firstFrame > INT32_MAX) { return false; }
+        if (count == 0 or count > INT32_MAX - firstFrame) { return false; }
+        header.Ack = (int32_t)ack - 1;
+        header.FirstFrame = (int32_t)firstFrame;
+        header.Count = (int32_t)count;
+
+        Input input{};
+        Fixed current{};
+        int32_t frame = (int32_t)firstFrame;
+        const int32_t endFrame = frame + (int32_t)count;
+        while (frame < endFrame)
+        {
+            uint64_t token;
+            if (not Get(packet, offset, token)) { return false; }
+
+            if ((token & 1) == 0)
+            {
+                const uint64_t repeats = token >> 1;
+                if (repeats == 0 or repeats > (uint64_t)(endFrame - frame))
+                {
+                    return false;
+                }
+                if constexpr (FIXED_SIZE > 0) { input.fixed = current; }
+                if constexpr (Input::DYNAMIC_SIZE) { input.dyn = {}; }
+                for (uint64_t r = 0; r < repeats; ++r)
+                {
+                    onInput(frame++, as_const(input));
+                }
+                continue;
+            }
+
+            if (packet.size() - offset < MASK_SIZE) [[unlikely]]
+            {
+                return false;
+            }
+            const uint8_t *mask = &packet[offset];
+            offset += MASK_SIZE;
+            for (size_t b = 0; b < FIXED_SIZE; ++b)
+            {
+                if ((mask[b / 8] & (1 << (b % 8))) == 0) { continue; }
+                if (offset == packet.size()) [[unlikely]] { return false; }
+                current[b] ^= packet[offset++];
+            }
+            if constexpr (FIXED_SIZE > 0) { input.fixed = current; }
+
+            if constexpr (Input::DYNAMIC_SIZE)
+            {
+                uint64_t dynSize;
+                if (not Get(packet, offset, dynSize)) { return false; }
+                if (packet.size() - offset < dynSize) [[unlikely]]
+                {
+                    return false;
+                }
+
+                // We only read it, and the slot copies it.
+                input.dyn = span{
+                    const_cast<uint8_t *>(packet.data()) + offset,
+                    (size_t)dynSize};
+                offset += dynSize;
+            }
+            onInput(frame++, as_const(input));
+        }
+        return offset == packet.size();
+    }
+
+private:
+    static bool Put(span<uint8_t> out, size_t &size, uint64_t value) noexcept
+    {
+        const size_t written = EncodeVarint(value, out.subspan(size));
+        size += written;
+        return written != 0;
+    }
+
+    static bool PutRepeats(span<uint8_t> out, size_t &size, int repeats)
+        noexcept
+    {
+        if (repeats == 0) { return true; }
+        return Put(out, size, (uint64_t)repeats << 1);
+    }
+
+    static bool Get(span<const uint8_t> in, size_t &offset, uint64_t &value)
+        noexcept
+    {
+        const size_t read = DecodeVarint(in.subspan(offset), value);
+        offset += read;
+        return read != 0;
+    }
+};
+
+// Find desyncs without checksumming every frame.
+//
+// Every `interval` frames (a boundary), when the frame is confirmed, we
+// checksum the state at the beginning of it, send it to the peers and compare
+// it with theirs. We also keep the state at each boundary (a keyframe) and
+// the confirmed inputs since then. On mismatch, we know the previous boundary
+// matched, so both sides load the previous keyframe, simulate the interval
+// again with the confirmed inputs to checksum every frame in it, and exchange
+// the lists. Then we bisect the lists to the first diverging frame.
+//
+// Checksum: [type] [player] [frame: 4, BE] [checksum: 8, BE]
+// Detail:   [type] [player] [frame: 4, BE] [count: 2, BE] [checksum: 8, BE]...
+// The detail lists the frames after the previous boundary up to `frame`.
+template <typename State, typename Slot, int NumPlayers, int MaxInterval>
+class DesyncDetector
+{
+public:
+    static constexpr int KEYFRAMES = 4;
+    static constexpr int HISTORY_SIZE =
+        (int)bit_ceil((uint32_t)(KEYFRAMES * MaxInterval));
+    static constexpr int HISTORY_MASK = HISTORY_SIZE - 1;
+    static constexpr size_t CHECKSUM_SIZE = 2 + 4 + 8;
+    static constexpr size_t DETAIL_HEADER_SIZE = 2 + 4 + 2;
+
+    using Input = remove_cvref_t<decltype(declval<Slot>().Data)>;
+
+    static_assert(MaxInterval > 0);
+    static_assert(DETAIL_HEADER_SIZE + 8 * MaxInterval <= InputPacket::CAPACITY,
+        "the detail must fit in an input packet");
+
+private:
+    // The comparison of a boundary.
+    struct Record
+    {
+        int32_t Frame = -1;
+        optional<uint64_t> Local;
+        array<optional<uint64_t>, NumPlayers> Remote;
+    };
+
+    int interval = 0;
+    int32_t nextBoundary = 0;
+
+    array<Record, KEYFRAMES * 2> records;
+    array<State, KEYFRAMES> keyframes;
+    array<int32_t, KEYFRAMES> keyframeFrames;
+    array<array<Slot, HISTORY_SIZE>, NumPlayers> history;
+
+    // Scratch for simulating an interval again.
+    State scratch;
+    array<Input, NumPlayers> scratchInputs;
+    int32_t detailFrame = -1;
+    array<uint64_t, MaxInterval> detail;
+    bool detailPending = false;
+
+    optional<DesyncReport> report;
+
+public:
+    DesyncDetector() noexcept
+    {
+        keyframeFrames.fill(-1);
+        for (auto &slots : history)
+        {
+            for (Slot &slot : slots) { slot.Clear(); }
+        }
+    }
+
+    // 0 disables it. It must be the same on all peers, and be set before
+    // the first frame.
+    void SetInterval(int newInterval) noexcept
+    {
+        interval = clamp(newInterval, 0, MaxInterval);
+    }
+
+    [[nodiscard]] int GetInterval() const noexcept { return interval; }
+
+    [[nodiscard]] const optional<DesyncReport> &GetReport() const noexcept
+    {
+        return report;
+    }
+
+    // The inputs of all players for this frame are confirmed.
+    template <typename GetSlot>
+    void OnFrameConfirmed(int32_t frame, GetSlot &&getSlot) noexcept
+    {
+        for (int p = 0; p < NumPlayers; ++p)
+        {
+            Slot &slot = history[p][frame & HISTORY_MASK];
+            slot.Assign(getSlot(p).Data);
+            slot.Frame = frame;
+            slot.Confirmed = true;
+        }
+    }
+
+    // The next frame whose state we want to checksum.
+    [[nodiscard]] optional<int32_t> GetNextBoundary() const noexcept
+    {
+        if (interval == 0 or report) { return nullopt; }
+        return nextBoundary;
+    }
+
+    // Checksum the confirmed state at the beginning of the boundary, and
+    // write the packet to send to every peer. Return the size written.
+    size_t OnBoundary(
+        const State &confirmed,
+        int localPlayer,
+        span<uint8_t> out,
+        KoiSynStats &stats
+        ) noexcept
+    {
+        const int32_t frame = nextBoundary;
+        nextBoundary += interval;
+
+        const int k = (frame / interval) % KEYFRAMES;
+        keyframes[k] = confirmed;
+        keyframeFrames[k] = frame;
+
+        const uint64_t checksum = GetChecksum_fn{}(confirmed);
+        Record &record = GetRecord(frame);
+        record.Local = checksum;
+        for (int p = 0; p < NumPlayers; ++p)
+        {
+            if (record.Remote[p]) { Compare(record, p, stats); }
+        }
+
+        if (out.size() < CHECKSUM_SIZE) [[unlikely]] { return 0; }
+        out[0] = (uint8_t)KoiSynPacket::Checksum;
+        out[1] = (uint8_t)localPlayer;
+        const uint32_t beFrame = htonl((uint32_t)frame);
+        memcpy(&out[2], &beFrame, 4);
+        StoreU64BE(&out[6], checksum);
+        return CHECKSUM_SIZE;
+    }
+
+    // Handle a checksum or a detail from the remote.
+    void OnPacket(span<const uint8_t> packet, KoiSynStats &stats) noexcept
+    {
+        if (interval == 0) { return; }
+        if (packet.size() < 2 + 4) [[unlikely]] { return; }
+        const int player = packet[1];
+        if (player >= NumPlayers) [[unlikely]] { return; }
+        uint32_t beFrame;
+        memcpy(&beFrame, &packet[2], 4);
+        const int32_t frame = (int32_t)ntohl(beFrame);
+        if (frame < 0 or frame % interval != 0) [[unlikely]] { return; }
+
+        if (packet[0] == (uint8_t)KoiSynPacket::Checksum)
+        {
+            if (packet.size() < CHECKSUM_SIZE) [[unlikely]] { return; }
+            if (report) { return; }
+
+            Record &record = GetRecord(frame);
+            record.Remote[player] = LoadU64BE(&packet[6]);
+            if (record.Local) { Compare(record, player, stats); }
+            return;
+        }
+
+        if (packet[0] == (uint8_t)KoiSynPacket::ChecksumDetail)
+        {
+            if (packet.size() < DETAIL_HEADER_SIZE) [[unlikely]] { return; }
+            uint16_t beCount;
+            memcpy(&beCount, &packet[6], 2);
+            const int count = ntohs(beCount);
+            if (count != interval) [[unlikely]] { return; }
+            if (packet.size() < DETAIL_HEADER_SIZE + 8 * count) { return; }
+
+            // Only bisect the desync we reported.
+            if (not report or report->Player != player) { return; }
+            if (report->LastFrame != frame) { return; }
+            if (not ComputeDetail(frame)) { return; }
+
+            // The states before the first diverging frame are the same, and
+            // all after it differ, so we can bisect.
+            int lo = 0;
+            int hi = count - 1;
+            while (lo < hi)
+            {
+                const int mid = (lo + hi) / 2;
+                const uint8_t *remote = &packet[DETAIL_HEADER_SIZE + 8 * mid];
+                if (detail[mid] == LoadU64BE(remote)) { lo = mid + 1; }
+                else { hi = mid; }
+            }
+            const int32_t first = frame - interval + 1 + lo;
+            const uint8_t *remote = &packet[DETAIL_HEADER_SIZE + 8 * lo];
+            report->FirstFrame = first;
+            report->LastFrame = first;
+            report->LocalChecksum = detail[lo];
+            report->RemoteChecksum = LoadU64BE(remote);
+        }
+    }
+
+    // After a mismatch is found, write the detail to send to the player in
+    // the report, and return its size.
+    size_t TakeDetail(int localPlayer, span<uint8_t> out) noexcept
+    {
+        if (not detailPending) { return 0; }
+        detailPending = false;
+        return EncodeDetail(report->LastFrame, localPlayer, out);
+    }
+
+private:
+    Record &GetRecord(int32_t frame) noexcept
+    {
+        Record &record = records[(frame / interval) % records.size()];
+        if (record.Frame != frame)
+        {
+            record = {};
+            record.Frame = frame;
+        }
+        return record;
+    }
+
+    // Return true if they match.
+    bool Compare(const Record &record, int player, KoiSynStats &stats)
+        noexcept
+    {
+        ++stats.DesyncChecks;
+        if (*record.Local == *record.Remote[player]) { return true; }
+        if (report) { return false; }
+
+        // We don't know which frame in the interval yet.
+        detailPending = true;
+        report = DesyncReport{
+            .Player = player,
+            .FirstFrame = max(record.Frame - interval + 1, 0),
+            .LastFrame = record.Frame,
+            .LocalChecksum = *record.Local,
+            .RemoteChecksum = *record.Remote[player],
+        };
+        return false;
+    }
+
+    size_t EncodeDetail(int32_t frame, int localPlayer, span<uint8_t> out)
+        noexcept
+    {
+        if (not ComputeDetail(frame)) { return 0; }
+
+        const size_t size = DETAIL_HEADER_SIZE + 8 * interval;
+        if (out.size() < size) [[unlikely]] { return 0; }
+        out[0] = (uint8_t)KoiSynPacket::ChecksumDetail;
+        out[1] = (uint8_t)localPlayer;
+        const uint32_t beFrame = htonl((uint32_t)frame);
+        const uint16_t beCount = htons((uint16_t)interval);
+        memcpy(&out[2], &beFrame, 4);
+        memcpy(&out[6], &beCount, 2);
+        for (int i = 0; i < interval; ++i)
+        {
+            StoreU64BE(&out[DETAIL_HEADER_SIZE + 8 * i], detail[i]);
+        }
+        return size;
+    }
+
+    // Simulate from the previous keyframe to this boundary, and checksum the
+    // state at the beginning of every frame after the keyframe.
+    // Return false if we don't keep the keyframe or inputs any more.
+    bool ComputeDetail(int32_t frame) noexcept
+    {
+        if (detailFrame == frame) { return true; }
+
+        const int32_t from = frame - interval;
+        if (from < 0) { return false; }
+        const int k = (from / interval) % KEYFRAMES;
+        if (keyframeFrames[k] != from) { return false; }
+        for (int p = 0; p < NumPlayers; ++p)
+        {
+            for (int32_t f = from; f < frame; ++f)
+            {
+                if (history[p][f & HISTORY_MASK].Frame != f) { return false; }
+            }
+        }
+
+        scratch = keyframes[k];
+        for (int32_t f = from; f < frame; ++f)
+        {
+            for (int p = 0; p < NumPlayers; ++p)
+            {
+                scratchInputs[p] = history[p][f & HISTORY_MASK].Data;
+            }
+            scratch.Advance(span<const Input>{scratchInputs});
+            detail[f - from] = GetChecksum_fn{}(scratch);
+        }
+        detailFrame = frame;
+        return true;
+    }
+};
+
 class KoiSynBase
 {
 public:
-    // TODO: need a thread safe queue
-    shared_ptr<queue<QUIC_BUFFER>> InputQueue;
+    // Filled by PushInputPacket and drained by Advance. It is shared so that
+    // a receive callback still running can outlive the engine.
+    shared_ptr<InputQueueType> InputQueue = make_shared<InputQueueType>();
 
     virtual ~KoiSynBase() noexcept {};
     virtual void Advance() = 0;
+
+    // Thread safe, lock free and allocation free. Call it in the receive
+    // callbacks (see Kontext) with the encoded input from the remote.
+    // Return false if the packet is too large or the queue is full, then the
+    // input is dropped.
+    bool PushInputPacket(span<const uint8_t> data) noexcept
+    {
+        if (data.size() > InputPacket::CAPACITY) [[unlikely]] { return false; }
+        return InputQueue->TryProduce([&](InputPacket &packet) noexcept
+        {
+            packet.Size = (uint16_t)data.size();
+            packet.ReceivedAt = steady_clock::now();
+            memcpy(packet.Data.data(), data.data(), data.size());
+            return true;
+        });
+    }
 };
 
+// Records the confirmed frames. See replay.h.
 template <ConceptGameState State>
+class ReplayWriter;
+
+// The rollback engine.
+//
+// We keep the snapshots of the state at the beginning of every frame which is
+// not confirmed yet, and the inputs of every player indexed by frame number.
+// Both of them are saved in fixed size rings, so there is no allocation after
+// construction. A frame is confirmed when the inputs of all players for it are
+// received, and its slots are reused when the ring wraps around.
+//
+// When an input of a remote player is missing, we predict it with the
+// Predictor (see predictor.h). When it arrives and differs from what we
+// predicted, we load the snapshot of that frame and simulate to the present
+// again at the next Advance().
+//
+// The engine sends its packets through the attached peers (see AttachPeer)
+// on the datagram channel, and the app should pass everything received there
+// to PushInputPacket.
+//
+// Not thread safe except PushInputPacket; it should be driven by the game
+// thread.
+template <
+    ConceptGameState State,
+    typename Predictor = RepeatLastPredictor<State::FIXED_INPUT_SIZE>>
+    requires copyable<State> and default_initializable<State> and // snapshot
+        ConceptInputPredictor<Predictor, State::FIXED_INPUT_SIZE>
 class KoiSyn final : public KoiSynBase
 {
 public:
-    ~KoiSyn() noexcept {}
-    void Advance() noexcept override {}
+    using Input = InputFor<State>;
+
+    static constexpr int NUM_PLAYERS = State::MAX_NUM_PLAYERS;
+    static constexpr int INPUT_DELAY = State::INPUT_DELAY_FRAME;
+    static constexpr int MAX_ROLLBACK = GetMaxRollbackFrame<State>();
+    static constexpr int MAX_DYNAMIC_SIZE = GetMaxDynamicInputSize<State>();
+    static constexpr int MAX_DESYNC_CHECK_INTERVAL =
+        GetMaxDesyncCheckInterval<State>();
+
+    static_assert(NUM_PLAYERS > 0);
+    static_assert(INPUT_DELAY >= 0);
+    static_assert(MAX_ROLLBACK > 0);
+    static_assert(MAX_DYNAMIC_SIZE >= 0 and MAX_DYNAMIC_SIZE <= 65535);
+
+    // The ring must hold every frame from the oldest unconfirmed one to the
+    // newest local input (delayed). Round it up to a power of 2 so that we can
+    // locate a slot by masking.
+    static constexpr int RING_SIZE =
+        (int)bit_ceil((uint32_t)(MAX_ROLLBACK + INPUT_DELAY + 2));
+    static constexpr int RING_MASK = RING_SIZE - 1;
+
+    // Ping the peers every this many frames.
+    static constexpr int TIME_SYNC_INTERVAL = 10;
+
+    using Slot = InputSlot<Input, MAX_DYNAMIC_SIZE>;
+
+    // Checksums are sent on this reliable channel by default.
+    static constexpr uint32_t DESYNC_CHANNEL = 3;
+
+    // Pass it as the local player to watch the match without playing.
+    static constexpr int SPECTATOR = -1;
+
+    // Confirmed inputs are sent to the spectators on this reliable channel,
+    // this many frames per packet.
+    static constexpr uint32_t SPECTATOR_CHANNEL = 2;
+    static constexpr int SPECTATOR_BATCH_FRAMES = 4;
+
+    // A spectator that hasn't acknowledged this many bytes is dropped, so
+    // that a slow one never holds the players back.
+    static constexpr uint64_t MAX_SPECTATOR_BACKLOG = 256 * 1024;
+
+    // Speculation only varies the fixed part of an input, so it is
+    // available when there is no dynamic part.
+    static constexpr bool CAN_SPECULATE = not Input::DYNAMIC_SIZE;
+    static constexpr int MAX_SPECULATIVE_BRANCHES = 3;
+
+private:
+    State state;
+    array<State, RING_SIZE> snapshots;
+    array<array<Slot, RING_SIZE>, NUM_PLAYERS> inputs;
+
+    // The newest confirmed input of every player, used to predict.
+    array<Slot, NUM_PLAYERS> lastConfirmed;
+    array<int32_t, NUM_PLAYERS> lastConfirmedFrame;
+    array<Predictor, NUM_PLAYERS> predictors;
+
+    // Every input of the player before or at this frame is confirmed.
+    array<int32_t, NUM_PLAYERS> confirmedUpTo;
+
+    // Inputs passed to State::Advance. The dynamic parts refer to the slots.
+    array<Input, NUM_PLAYERS> frameInputs;
+
+    int localPlayer;
+    int32_t currentFrame = 0; // the next frame to simulate
+    int32_t firstIncorrectFrame = -1;
+    int32_t historyUpTo = INPUT_DELAY - 1;
+
+    array<optional<KoiChan>, NUM_PLAYERS> peers;
+    TimeSync<NUM_PLAYERS> timeSync{State::FRAME_RATE};
+    RedundancyWindow<NUM_PLAYERS> redundancy;
+
+    using Detector =
+        DesyncDetector<State, Slot, NUM_PLAYERS, MAX_DESYNC_CHECK_INTERVAL>;
+    Detector desync;
+    uint32_t desyncChannel = DESYNC_CHANNEL;
+
+    ReplayWriter<State> *replay = nullptr;
+    int32_t nextKeyframe = 0;
+
+    // Confirmed inputs are encoded once into the batch and the same buffer is
+    // sent to every spectator.
+    // Spectate: [type] [first frame: 4, BE] [count: 1]
+    // then for each frame and each player: [fixed part] and, if the input
+    // has a dynamic part, [size: 2, BE] [dynamic part].
+    vector<KoiChan> spectators;
+    uint32_t spectatorChannel = SPECTATOR_CHANNEL;
+    array<uint8_t, InputPacket::CAPACITY> spectateBatch;
+    size_t spectateSize = 0;
+    int spectateCount = 0;
+
+    // The frames from From to To simulated by a worker with an alternative
+    // input of the first player predicted at From.
+    struct Branch
+    {
+        const KoiSyn *Engine = nullptr;
+        int32_t From = 0;
+        int32_t To = 0;
+        array<array<array<uint8_t, Input::FIXED_SIZE>, NUM_PLAYERS>, RING_SIZE>
+            Inputs;
+        array<State, RING_SIZE> Snapshots;
+        State Result;
+    };
+
+    array<InputCandidates<Input::FIXED_SIZE>, NUM_PLAYERS> candidates;
+    unique_ptr<Branch[]> branches;
+    int numBranches = 0; // started for the current frame
+
+    KoiSynStats stats;
+
+    // Declared last so that the workers stop before anything they use is
+    // destroyed.
+    WorkerPool speculationPool;
+
+public:
+    // The frames before INPUT_DELAY_FRAME have no input from anyone; we treat
+    // them as confirmed empty inputs.
+    explicit KoiSyn(const State &initial, int localPlayer = 0) noexcept :
+        state{initial},
+        localPlayer{localPlayer}
+    {
+        for (int p = 0; p < NUM_PLAYERS; ++p)
+        {
+            for (Slot &slot : inputs[p])
+            {
+                slot.Clear();
+            }
+            for (int32_t f = 0; f < INPUT_DELAY; ++f)
+            {
+                Slot &slot = inputs[p][f & RING_MASK];
+                slot.Frame = f;
+                slot.Confirmed = true;
+            }
+            lastConfirmed[p].Clear();
+            lastConfirmedFrame[p] = INPUT_DELAY - 1;
+            confirmedUpTo[p] = INPUT_DELAY - 1;
+        }
+        for (int32_t f = 0; f < INPUT_DELAY; ++f)
+        {
+            desync.OnFrameConfirmed(f, [&](int p) -> const Slot &
+            {
+                return inputs[p][f & RING_MASK];
+            });
+        }
+    }
+
+    ~KoiSyn() noexcept
+    {
+        speculationPool.Stop();
+    }
+
+    [[nodiscard]] const State &GetState() const noexcept { return state; }
+    [[nodiscard]] int GetLocalPlayer() const noexcept { return localPlayer; }
+    [[nodiscard]] const KoiSynStats &GetStats() const noexcept { return stats; }
+
+    // The next frame to simulate.
+    [[nodiscard]] int32_t GetFrame() const noexcept { return currentFrame; }
+
+    // Every input before or at this frame is confirmed.
+    [[nodiscard]] int32_t GetConfirmedFrame() const noexcept
+    {
+        return ranges::min(confirmedUpTo);
+    }
+
+    // Send our packets to this player through the channel.
+    void AttachPeer(int player, KoiChan channel) noexcept
+    {
+        if (player < 0 or player >= NUM_PLAYERS) [[unlikely]] { return; }
+        if (player == localPlayer) [[unlikely]] { return; }
+        peers[player] = channel;
+        timeSync.Reset(player);
+        redundancy.Reset(player);
+    }
+
+    void DetachPeer(int player) noexcept
+    {
+        if (player < 0 or player >= NUM_PLAYERS) [[unlikely]] { return; }
+        peers[player].reset();
+        timeSync.Reset(player);
+        redundancy.Reset(player);
+    }
+
+    // Send the confirmed inputs to a spectator from now on. The spectator
+    // should join before the match starts, since it simulates from the
+    // initial state. It is disconnected if it falls behind, or if the
+    // inputs of a frame don't fit a packet; both count in
+    // KoiSynStats::DroppedSpectators. Return false if we can't allocate for
+    // it.
+    bool AddSpectator(KoiChan channel) noexcept
+    try
+    {
+        if (channel == nullptr) [[unlikely]] { return false; }
+        spectators.push_back(channel);
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+
+    void RemoveSpectator(KoiChan channel) noexcept
+    {
+        erase_if(spectators, [&](KoiChan &spectator) noexcept
+        {
+            return spectator.handle == channel.handle;
+        });
+    }
+
+    [[nodiscard]] size_t GetNumSpectators() const noexcept
+    {
+        return spectators.size();
+    }
+
+    // The spectators must receive on the same channel.
+    void SetSpectatorChannel(uint32_t channel) noexcept
+    {
+        spectatorChannel = channel;
+    }
+
+    // Record the confirmed frames and keyframes from frame 0. It must be set
+    // before the first Advance(), and the writer must outlive the engine or
+    // be reset with nullptr. Return false if it is too late.
+    bool SetReplayWriter(ReplayWriter<State> *writer) noexcept
+    {
+        if (currentFrame != 0) [[unlikely]] { return false; }
+        replay = writer;
+        nextKeyframe = 0;
+        if (replay == nullptr) { return true; }
+        for (int32_t f = 0; f <= historyUpTo; ++f)
+        {
+            PushReplayFrame(f);
+        }
+        return true;
+    }
+
+    // Simulate the most likely alternatives of an unknown remote input ahead
+    // of time on `cores` worker threads (one branch per core per frame, up to
+    // MAX_SPECULATIVE_BRANCHES), while the app is busy between Advance()
+    // calls. When the real input matches a branch, we swap the branch in
+    // instead of rolling back. Every branch copies the state once per frame,
+    // so it fits states that are cheap to copy. 0 disables it.
+    // Return false if the workers can't be started.
+    bool SetSpeculation(int cores) noexcept requires CAN_SPECULATE
+    {
+        speculationPool.Stop();
+        branches.reset();
+        numBranches = 0;
+
+        cores = min(cores, MAX_SPECULATIVE_BRANCHES);
+        if (cores <= 0) { return true; }
+        branches.reset(new(nothrow) Branch[cores]);
+        if (not branches) [[unlikely]] { return false; }
+        if (not speculationPool.Start(cores))
+        {
+            branches.reset();
+            return false;
+        }
+        return true;
+    }
+
+    // Compare the checksums of confirmed frames with the peers every
+    // `interval` frames on the reliable channel (up to
+    // MAX_DESYNC_CHECK_INTERVAL, and 0 disables it). It must be the same on
+    // all peers, and be set before the first Advance(). The peers should pass
+    // everything received on that channel to PushInputPacket too.
+    void SetDesyncCheck(int interval, uint32_t channel = DESYNC_CHANNEL)
+        noexcept
+    {
+        desync.SetInterval(interval);
+        desyncChannel = channel;
+    }
+
+    // The first desync found. See DesyncReport.
+    [[nodiscard]] const optional<DesyncReport> &GetDesyncReport()
+        const noexcept
+    {
+        return desync.GetReport();
+    }
+
+    [[nodiscard]] const TimeSync<NUM_PLAYERS> &GetTimeSync() const noexcept
+    {
+        return timeSync;
+    }
+
+    // The frames the app should skip calling Advance() to let the slowest
+    // peer catch up. See TimeSync.
+    [[nodiscard]] int TakeRecommendedStall() noexcept
+    {
+        return timeSync.TakeRecommendedStall();
+    }
+
+    // The multiplier of the frame duration if the app prefers time dilation
+    // to stalls. See TimeSync.
+    [[nodiscard]] double GetRecommendedTimeScale() const noexcept
+    {
+        return timeSync.GetRecommendedTimeScale();
+    }
+
+    // Save the input of the local player for the frame after the input delay,
+    // and send it to the peers. Only the first call in a frame counts: the
+    // input is sent at once, so a later call keeps it and sends it again.
+    // Return the frame number of this input, or nullopt if it can't be saved.
+    optional<int32_t> AddLocalInput(const Input &input) noexcept
+    {
+        if (localPlayer == SPECTATOR) [[unlikely]] { return nullopt; }
+        const int32_t frame = currentFrame + INPUT_DELAY;
+        if (not SaveInput(localPlayer, frame, input)) { return nullopt; }
+        SendLocalInput(frame);
+        return frame;
+    }
+
+    // Save an input of a remote player. If we have simulated that frame with a
+    // wrong prediction, we will roll back at the next Advance().
+    // Return false if the input is out of the window we can hold.
+    bool AddRemoteInput(int player, int32_t frame, const Input &input)
+        noexcept
+    {
+        if (player < 0 or player >= NUM_PLAYERS) [[unlikely]] { return false; }
+        if (player == localPlayer) [[unlikely]] { return false; }
+        return SaveInput(player, frame, input);
+    }
+
+    // Simulate one frame, rolling back first if a misprediction is detected.
+    // If we have run too far ahead of the confirmed frame, we don't simulate
+    // (stall) and wait for the remote inputs. A spectator never predicts; it
+    // stalls until the frame is confirmed.
+    void Advance() noexcept override
+    {
+        speculationPool.Wait();
+        DrainInputQueue();
+        FlushSpectate(SPECTATOR_BATCH_FRAMES);
+
+        if (localPlayer == SPECTATOR)
+        {
+            RecordKeyframes();
+            if (currentFrame > GetConfirmedFrame())
+            {
+                ++stats.Stalls;
+                return;
+            }
+            SimulateFrame(currentFrame);
+            ++currentFrame;
+            return;
+        }
+
+        if (firstIncorrectFrame != -1)
+        {
+            if (not AdoptBranch(firstIncorrectFrame))
+            {
+                Rollback(firstIncorrectFrame);
+            }
+            firstIncorrectFrame = -1;
+            numBranches = 0;
+        }
+
+        CheckDesync();
+        RecordKeyframes();
+
+        const int32_t syncFrame = GetConfirmedFrame() + 1;
+        if (currentFrame - syncFrame >= MAX_ROLLBACK)
+        {
+            ++stats.Stalls;
+            return;
+        }
+
+        // The app didn't provide the local input in time; repeat the last one
+        // and send it as usual.
+        const int32_t localFrame = currentFrame + INPUT_DELAY;
+        Slot &localSlot = inputs[localPlayer][localFrame & RING_MASK];
+        if (localSlot.Frame != localFrame or not localSlot.Confirmed)
+        {
+            SaveInput(localPlayer, localFrame, lastConfirmed[localPlayer].Data);
+            SendLocalInput(localFrame);
+        }
+
+        if (currentFrame % TIME_SYNC_INTERVAL == 0)
+        {
+            array<uint8_t, TimeSync<NUM_PLAYERS>::PING_SIZE> ping;
+            size_t size = timeSync.EncodePing(
+                localPlayer, currentFrame, steady_clock::now(), ping);
+            SendToPeers(span{ping.data(), size});
+        }
+
+        SimulateFrame(currentFrame);
+        ++currentFrame;
+        Speculate();
+    }
+
+    // Encode the local input of the frame to send it to the remote.
+    // Return the size written.
+    [[nodiscard]] optional<size_t> EncodeLocalInput(
+        int32_t frame, span<uint8_t> out) const noexcept
+    {
+        if (localPlayer == SPECTATOR) [[unlikely]] { return nullopt; }
+        const Slot &slot = inputs[localPlayer][frame & RING_MASK];
+        if (slot.Frame != frame or not slot.Confirmed) { return nullopt; }
+        const InputHeader header{
+            .Player = localPlayer, .FirstFrame = frame, .Count = 1};
+        return InputCodec<Input>::Encode(header,
+            [&](int) -> const Input & { return slot.Data; }, out);
+    }
+
+private:
+    [[nodiscard]] bool HasLocalInput(int32_t frame) const noexcept
+    {
+        const Slot &slot = inputs[localPlayer][frame & RING_MASK];
+        return slot.Frame == frame and slot.Confirmed;
+    }
+
+    // Send every peer our newest input with the previous ones it may have
+    // missed (see RedundancyWindow), so a lost packet doesn't stall it. If
+    // they don't fit in a packet, we send fewer.
+    void SendLocalInput(int32_t newest) noexcept
+    {
+        if (not HasLocalInput(newest)) [[unlikely]] { return; }
+        array<uint8_t, InputPacket::CAPACITY> buffer;
+        for (int p = 0; p < NUM_PLAYERS; ++p)
+        {
+            if (not peers[p]) { continue; }
+            int32_t first = redundancy.GetFirstFrame(
+                p, newest, timeSync.GetRtt(p), State::FRAME_RATE);
+            first = max({first, newest - RING_SIZE + 1, 0});
+            int32_t available = newest;
+            while (available > first and HasLocalInput(available - 1))
+            {
+                --available;
+            }
+
+            InputHeader header{
+                .Player = localPlayer,
+                .Ack = confirmedUpTo[p],
+                .Loss = redundancy.GetLossReport(p),
+                .FirstFrame = available,
+                .Count = newest - available + 1};
+            optional<size_t> size;
+            while (true)
+            {
+                size = InputCodec<Input>::Encode(header,
+                    [&](int i) -> const Input &
+                    {
+                        const int32_t f = header.FirstFrame + i;
+                        return inputs[localPlayer][f & RING_MASK].Data;
+                    }, buffer);
+                if (size or header.Count == 1) { break; }
+                header.Count /= 2;
+                header.FirstFrame = newest - header.Count + 1;
+            }
+            if (not size) [[unlikely]] { continue; }
+            stats.RedundantInputs += header.Count - 1;
+            peers[p]->UnreliablePacketSend(span{buffer.data(), *size});
+        }
+    }
+
+    void SendToPeers(span<const uint8_t> data) noexcept
+    {
+        for (optional<KoiChan> &peer : peers)
+        {
+            if (peer) { peer->UnreliablePacketSend(data); }
+        }
+    }
+
+    // Checksum every boundary whose state is confirmed. The state at the
+    // beginning of a frame is confirmed when every input before it is.
+    void CheckDesync() noexcept
+    {
+        const int32_t upTo = min(GetConfirmedFrame() + 1, currentFrame);
+        optional<int32_t> boundary;
+        while ((boundary = desync.GetNextBoundary()) and *boundary <= upTo)
+        {
+            const State &confirmed = *boundary == currentFrame ?
+                state : snapshots[*boundary & RING_MASK];
+            array<uint8_t, Detector::CHECKSUM_SIZE> packet;
+            size_t size = desync.OnBoundary(
+                confirmed, localPlayer, packet, stats);
+
+            for (optional<KoiChan> &peer : peers)
+            {
+                if (not peer) { continue; }
+                peer->ReliablePacketSend(
+                    desyncChannel, span{packet.data(), size});
+            }
+            SendDesyncDetail();
+        }
+    }
+
+    void SendDesyncDetail() noexcept
+    {
+        array<uint8_t, InputPacket::CAPACITY> detail;
+        size_t size = desync.TakeDetail(localPlayer, detail);
+        if (size == 0) { return; }
+
+        optional<KoiChan> &peer = peers[desync.GetReport()->Player];
+        if (not peer) { return; }
+        peer->ReliablePacketSend(desyncChannel, span{detail.data(), size});
+    }
+
+    // Save the state at every keyframe whose state is confirmed, like the
+    // desync checks.
+    void RecordKeyframes() noexcept
+    {
+        if (replay == nullptr) { return; }
+        const int32_t upTo = min(GetConfirmedFrame() + 1, currentFrame);
+        while (nextKeyframe <= upTo)
+        {
+            const State &confirmed = nextKeyframe == currentFrame ?
+                state : snapshots[nextKeyframe & RING_MASK];
+            replay->PushKeyframe(nextKeyframe, confirmed);
+            nextKeyframe += replay->GetKeyframeInterval();
+        }
+    }
+
+    void PushReplayFrame(int32_t frame) noexcept
+    {
+        array<Input, NUM_PLAYERS> confirmed;
+        for (int p = 0; p < NUM_PLAYERS; ++p)
+        {
+            confirmed[p] = inputs[p][frame & RING_MASK].Data;
+        }
+        replay->PushFrame(frame, confirmed);
+    }
+
+    // Read all of the packets arrived since the last frame at once.
+    void DrainInputQueue() noexcept
+    {
+        const steady_clock::time_point now = steady_clock::now();
+        InputQueue->Drain([&](const InputPacket &packet) noexcept
+        {
+            span<const uint8_t> data = packet.Get();
+            if (data.empty()) [[unlikely]] { return; }
+
+            switch ((KoiSynPacket)data[0])
+            {
+            case KoiSynPacket::Input:
+            {
+                InputHeader header;
+                const bool valid = InputCodec<Input>::Decode(data, header,
+                    [&](int32_t frame, const Input &input) noexcept
+                    {
+                        AddRemoteInput(header.Player, frame, input);
+                    });
+                const int player = header.Player;
+                if (not valid or player >= NUM_PLAYERS) [[unlikely]]
+                {
+                    return;
+                }
+                if (player == localPlayer) [[unlikely]] { return; }
+                redundancy.OnPacket(player, header.Ack, header.Loss,
+                    header.FirstFrame + header.Count - 1);
+                return;
+            }
+            case KoiSynPacket::Checksum:
+            case KoiSynPacket::ChecksumDetail:
+            {
+                desync.OnPacket(data, stats);
+                SendDesyncDetail();
+                return;
+            }
+            case KoiSynPacket::Spectate:
+            {
+                if (localPlayer == SPECTATOR) { ReadSpectate(data); }
+                return;
+            }
+            case KoiSynPacket::Ping:
+            case KoiSynPacket::Pong:
+            {
+                array<uint8_t, TimeSync<NUM_PLAYERS>::PONG_SIZE> reply;
+                size_t size = timeSync.OnPacket(data, packet.ReceivedAt, now,
+                    localPlayer, currentFrame, reply);
+                // Only a whole ping gets a reply; a pong or a short packet
+                // may not even have the player.
+                if (size == 0) { return; }
+                const int player = data[1];
+                if (player < NUM_PLAYERS and peers[player])
+                {
+                    peers[player]->UnreliablePacketSend(
+                        span{reply.data(), size});
+                }
+                return;
+            }
+            default:
+                return;
+            }
+        });
+    }
+
+    bool SaveInput(int player, int32_t frame, const Input &input) noexcept
+    {
+        // Too old, and we have confirmed it.
+        if (frame <= confirmedUpTo[player]) { return true; }
+
+        // Too new, and we will overwrite a slot still in use. A pending
+        // rollback still needs the inputs from the incorrect frame, and the
+        // frames not simulated yet need theirs.
+        int32_t oldestInUse = min(GetConfirmedFrame() + 1, currentFrame);
+        if (firstIncorrectFrame != -1)
+        {
+            oldestInUse = min(oldestInUse, firstIncorrectFrame);
+        }
+        if (frame >= oldestInUse + RING_SIZE) [[unlikely]] { return false; }
+
+        Slot &slot = inputs[player][frame & RING_MASK];
+        if (slot.Frame == frame and slot.Confirmed) { return true; }
+
+        // We have simulated this frame with a prediction; check it.
+        const bool predicted = slot.Frame == frame and frame < currentFrame;
+        if (predicted) { ++stats.Predictions; }
+        if (predicted and not InputEquals(slot.Data, input))
+        {
+            ++stats.Mispredictions;
+            if (firstIncorrectFrame == -1 or frame < firstIncorrectFrame)
+            {
+                firstIncorrectFrame = frame;
+            }
+        }
+
+        if (not slot.Assign(input)) [[unlikely]] { return false; }
+        slot.Frame = frame;
+        slot.Confirmed = true;
+
+        if (frame > lastConfirmedFrame[player])
+        {
+            lastConfirmed[player].Assign(slot.Data);
+            lastConfirmedFrame[player] = frame;
+        }
+
+        // Inputs may arrive out of order, so we walk through the contiguous
+        // confirmed slots, and feed the predictor in order.
+        int32_t upTo = confirmedUpTo[player];
+        while (true)
+        {
+            const Slot &next = inputs[player][(upTo + 1) & RING_MASK];
+            if (next.Frame != upTo + 1 or not next.Confirmed) { break; }
+            if constexpr (Input::FIXED_SIZE > 0)
+            {
+                if (player != localPlayer)
+                {
+                    predictors[player].Observe(next.Data.fixed);
+                    if (branches)
+                    {
+                        candidates[player].Observe(next.Data.fixed);
+                    }
+                }
+            }
+            ++upTo;
+        }
+        confirmedUpTo[player] = upTo;
+
+        // The inputs of a frame confirmed by everyone are still in the ring
+        // since we never overwrite a frame newer than the confirmed one.
+        for (int32_t f = historyUpTo + 1; f <= GetConfirmedFrame(); ++f)
+        {
+            OnFrameConfirmed(f);
+            historyUpTo = f;
+        }
+
+        return true;
+    }
+
+    // Keep the inputs of the frame for desync detection, and pass them on to
+    // the replay and the spectators.
+    void OnFrameConfirmed(int32_t frame) noexcept
+    {
+        desync.OnFrameConfirmed(frame, [&](int p) -> const Slot &
+        {
+            return inputs[p][frame & RING_MASK];
+        });
+        if (replay != nullptr) { PushReplayFrame(frame); }
+        if (not spectators.empty()) { AppendSpectate(frame); }
+    }
+
+    void AppendSpectate(int32_t frame) noexcept
+    {
+        constexpr size_t headerSize = 1 + 4 + 1;
+
+        size_t frameSize = 0;
+        for (int p = 0; p < NUM_PLAYERS; ++p)
+        {
+            frameSize += Input::FIXED_SIZE;
+            if constexpr (Input::DYNAMIC_SIZE)
+            {
+                frameSize += 2 + inputs[p][frame & RING_MASK].Data.dyn.size();
+            }
+        }
+
+        if (spectateSize + frameSize > spectateBatch.size())
+        {
+            FlushSpectate(1);
+        }
+
+        // The spectators can't receive a packet larger than the input queue
+        // holds, and would stall at this frame, so we drop them.
+        if (headerSize + frameSize > spectateBatch.size()) [[unlikely]]
+        {
+            for (KoiChan &spectator : spectators) { spectator.Disconnect(); }
+            stats.DroppedSpectators += spectators.size();
+            spectators.clear();
+            return;
+        }
+
+        if (spectateCount == 0)
+        {
+            const uint32_t beFrame = htonl((uint32_t)frame);
+            spectateBatch[0] = (uint8_t)KoiSynPacket::Spectate;
+            memcpy(&spectateBatch[1], &beFrame, 4);
+            spectateSize = headerSize;
+        }
+
+        uint8_t *out = spectateBatch.data() + spectateSize;
+        for (int p = 0; p < NUM_PLAYERS; ++p)
+        {
+            const Input &input = inputs[p][frame & RING_MASK].Data;
+            if constexpr (Input::FIXED_SIZE > 0)
+            {
+                memcpy(out, input.fixed.data(), Input::FIXED_SIZE);
+                out += Input::FIXED_SIZE;
+            }
+            if constexpr (Input::DYNAMIC_SIZE)
+            {
+                const uint16_t beSize = htons((uint16_t)input.dyn.size());
+                memcpy(out, &beSize, 2);
+                out += 2;
+                if (not input.dyn.empty())
+                {
+                    memcpy(out, input.dyn.data(), input.dyn.size());
+                    out += input.dyn.size();
+                }
+            }
+        }
+        spectateSize += frameSize;
+        spectateBatch[5] = (uint8_t)++spectateCount;
+    }
+
+    // Send the batch if it has at least `minFrames` frames. Spectators who
+    // still haven't acknowledged too much are disconnected instead of being
+    // buffered for.
+    void FlushSpectate(int minFrames) noexcept
+    {
+        if (spectateCount == 0 or spectateCount < minFrames) { return; }
+
+        erase_if(spectators, [&](KoiChan &spectator) noexcept
+        {
+            if (spectator.GetSendingBytes() <= MAX_SPECTATOR_BACKLOG)
+            {
+                return false;
+            }
+            spectator.Disconnect();
+            ++stats.DroppedSpectators;
+            return true;
+        });
+
+        KoiChan::ReliableMulticast(spectators, spectatorChannel,
+            span{spectateBatch.data(), spectateSize}, MAX_SPECTATOR_BACKLOG);
+        spectateSize = 0;
+        spectateCount = 0;
+    }
+
+    // Save the inputs in a batch from the players. If they arrive faster than
+    // we simulate, we skip ahead rather than fall further behind.
+    void ReadSpectate(span<const uint8_t> packet) noexcept
+    {
+        constexpr size_t headerSize = 1 + 4 + 1;
+        if (packet.size() < headerSize) [[unlikely]] { return; }
+
+        uint32_t beFrame;
+        memcpy(&beFrame, &packet[1], 4);
+        const int32_t firstFrame = (int32_t)ntohl(beFrame);
+        const int count = packet[5];
+
+        size_t offset = headerSize;
+        for (int i = 0; i < count; ++i)
+        {
+            const int32_t frame = firstFrame + i;
+            while (frame >= currentFrame + RING_SIZE and
+                currentFrame <= GetConfirmedFrame())
+            {
+                SimulateFrame(currentFrame);
+                ++currentFrame;
+                RecordKeyframes();
+            }
+
+            for (int p = 0; p < NUM_PLAYERS; ++p)
+            {
+                Input input{};
+                if (packet.size() - offset < Input::FIXED_SIZE) [[unlikely]]
+                {
+                    return;
+                }
+                if constexpr (Input::FIXED_SIZE > 0)
+                {
+                    memcpy(input.fixed.data(), &packet[offset],
+                        Input::FIXED_SIZE);
+                    offset += Input::FIXED_SIZE;
+                }
+                if constexpr (Input::DYNAMIC_SIZE)
+                {
+                    if (packet.size() - offset < 2) [[unlikely]] { return; }
+                    uint16_t beSize;
+                    memcpy(&beSize, &packet[offset], 2);
+                    const size_t size = ntohs(beSize);
+                    offset += 2;
+                    if (packet.size() - offset < size) [[unlikely]] { return; }
+
+                    // We only read it, and the slot copies it.
+                    input.dyn = span{
+                        const_cast<uint8_t *>(packet.data()) + offset, size};
+                    offset += size;
+                }
+                SaveInput(p, frame, input);
+            }
+        }
+    }
+
+    // Start the branches for the oldest frame with a predicted input. The
+    // inputs of a branch are prepared here, so the worker only reads the
+    // snapshot, which we don't touch until we wait for it.
+    void Speculate() noexcept
+    {
+        numBranches = 0;
+        if constexpr (CAN_SPECULATE)
+        {
+            if (not branches) { return; }
+            const int32_t from = GetConfirmedFrame() + 1;
+            if (from >= currentFrame) { return; }
+
+            // Some player hasn't confirmed it, or it would be confirmed.
+            int player = 0;
+            while (player < NUM_PLAYERS - 1 and
+                confirmedUpTo[player] >= from)
+            {
+                ++player;
+            }
+            const Slot &predicted = inputs[player][from & RING_MASK];
+
+            using Fixed = array<uint8_t, Input::FIXED_SIZE>;
+            array<Fixed, MAX_SPECULATIVE_BRANCHES> alternatives;
+            const int count = candidates[player].GetTop(predicted.Data.fixed,
+                span{alternatives.data(),
+                    (size_t)speculationPool.GetNumWorkers()});
+
+            for (int i = 0; i < count; ++i)
+            {
+                // Predict the later frames as we will do once the alternative
+                // is confirmed.
+                Predictor predictor = predictors[player];
+                predictor.Observe(alternatives[i]);
+                const Fixed &last = lastConfirmedFrame[player] < from ?
+                    alternatives[i] : lastConfirmed[player].Data.fixed;
+                Fixed later;
+                predictor.Predict(last, later);
+
+                Branch &branch = branches[i];
+                branch.Engine = this;
+                branch.From = from;
+                branch.To = currentFrame;
+                for (int32_t f = from; f < currentFrame; ++f)
+                {
+                    for (int p = 0; p < NUM_PLAYERS; ++p)
+                    {
+                        const Slot &slot = inputs[p][f & RING_MASK];
+                        Fixed &in = branch.Inputs[f & RING_MASK][p];
+                        if (p != player or IsConfirmed(slot, f))
+                        {
+                            in = slot.Data.fixed;
+                        }
+                        else { in = f == from ? alternatives[i] : later; }
+                    }
+                }
+                speculationPool.Run(i, &SimulateBranch, &branch);
+                ++stats.SpeculativeBranches;
+            }
+            numBranches = count;
+        }
+    }
+
+    [[nodiscard]] static bool IsConfirmed(const Slot &slot, int32_t frame)
+        noexcept
+    {
+        return slot.Frame == frame and slot.Confirmed;
+    }
+
+    static void SimulateBranch(void *context) noexcept
+    {
+        if constexpr (CAN_SPECULATE)
+        {
+            Branch &branch = *(Branch *)context;
+            State simulated = branch.Engine->snapshots[branch.From & RING_MASK];
+            array<Input, NUM_PLAYERS> branchInputs;
+            for (int32_t f = branch.From; f < branch.To; ++f)
+            {
+                branch.Snapshots[f & RING_MASK] = simulated;
+                for (int p = 0; p < NUM_PLAYERS; ++p)
+                {
+                    branchInputs[p].fixed = branch.Inputs[f & RING_MASK][p];
+                }
+                simulated.Advance(span<const Input>{branchInputs});
+            }
+            branch.Result = move(simulated);
+        }
+    }
+
+    // Swap in a branch that has simulated exactly what the rollback would,
+    // i.e. the frames before it are correct, and it used the inputs we know
+    // now and the predictions we would make now.
+    bool AdoptBranch(int32_t firstIncorrect) noexcept
+    {
+        if constexpr (CAN_SPECULATE)
+        {
+            if (not branches) { return false; }
+
+            using Fixed = array<uint8_t, Input::FIXED_SIZE>;
+            array<Fixed, NUM_PLAYERS> predicted;
+            for (int p = 0; p < NUM_PLAYERS; ++p)
+            {
+                const Input &last = lastConfirmed[p].Data;
+                predictors[p].Predict(last.fixed, predicted[p]);
+            }
+
+            for (int i = 0; i < numBranches; ++i)
+            {
+                Branch &branch = branches[i];
+                if (branch.To != currentFrame) { continue; }
+                if (branch.From > firstIncorrect) { continue; }
+
+                bool matched = true;
+                for (int32_t f = branch.From; f < branch.To and matched; ++f)
+                {
+                    for (int p = 0; p < NUM_PLAYERS; ++p)
+                    {
+                        const Slot &slot = inputs[p][f & RING_MASK];
+                        const Fixed &expected = IsConfirmed(slot, f) ?
+                            slot.Data.fixed : predicted[p];
+                        if (branch.Inputs[f & RING_MASK][p] != expected)
+                        {
+                            matched = false;
+                            break;
+                        }
+                    }
+                }
+                if (not matched) { continue; }
+
+                for (int32_t f = branch.From; f < branch.To; ++f)
+                {
+                    snapshots[f & RING_MASK] = branch.Snapshots[f & RING_MASK];
+                    for (int p = 0; p < NUM_PLAYERS; ++p)
+                    {
+                        Slot &slot = inputs[p][f & RING_MASK];
+                        if (not IsConfirmed(slot, f))
+                        {
+                            slot.Data.fixed = predicted[p];
+                        }
+                    }
+                }
+                state = branch.Result;
+                ++stats.SpeculationHits;
+                return true;
+            }
+            ++stats.SpeculationMisses;
+        }
+        return false;
+    }
+
+    void Rollback(int32_t frame) noexcept
+    {
+        const int32_t depth = currentFrame - frame;
+        ++stats.Rollbacks;
+        stats.ResimulatedFrames += depth;
+        stats.MaxRollbackDepth = max(stats.MaxRollbackDepth, depth);
+
+        state = snapshots[frame & RING_MASK];
+        for (int32_t f = frame; f < currentFrame; ++f)
+        {
+            SimulateFrame(f);
+        }
+    }
+
+    void SimulateFrame(int32_t frame) noexcept
+    {
+        snapshots[frame & RING_MASK] = state;
+
+        for (int p = 0; p < NUM_PLAYERS; ++p)
+        {
+            Slot &slot = inputs[p][frame & RING_MASK];
+            if (slot.Frame != frame or not slot.Confirmed)
+            {
+                const Input &last = lastConfirmed[p].Data;
+                slot.Assign(last);
+                if constexpr (Input::FIXED_SIZE > 0)
+                {
+                    predictors[p].Predict(last.fixed, slot.Data.fixed);
+                }
+                slot.Frame = frame;
+                slot.Confirmed = false;
+            }
+            frameInputs[p] = slot.Data;
+        }
+
+        state.Advance(span<const Input>{frameInputs});
+    }
 };
 
 } // namespace ks3::detail
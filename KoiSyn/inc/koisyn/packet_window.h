@@ -0,0 +1,91 @@
+#pragma once
+
+#include "std/std_precomp.h"
+#include "fec.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// Which of the last SIZE packet numbers up to the newest have been received.
+// A datagram newer than all the others is accepted however many were lost
+// before it, and one within the window is accepted once, so the copies sent
+// on the other connection are dropped. It is not thread safe; call it under
+// DatagramChannel::RecvMutex.
+class PacketWindow
+{
+public:
+    static constexpr uint32_t SIZE = 128;
+
+    enum class Arrival : uint8_t
+    {
+        Newest,    // after every packet received
+        Late,      // within the window, and not received yet
+        Duplicate,
+        TooOld,    // before the window
+    };
+
+private:
+    array<uint64_t, SIZE / 64> received{};
+    uint32_t newest = PACKET_NUMBER_MASK; // so that 0 is the next
+
+public:
+    void Reset() noexcept
+    {
+        received = {};
+        newest = PACKET_NUMBER_MASK;
+    }
+
+    // Mark the packet received, and tell how it arrived.
+    [[nodiscard]] Arrival OnPacket(uint32_t number) noexcept
+    {
+        number &= PACKET_NUMBER_MASK;
+        const uint32_t next = (newest + 1) & PACKET_NUMBER_MASK;
+        if (IsAtOrAfter(number, next))
+        {
+            // Forget the numbers the window slides past.
+            const uint32_t ahead = (number - newest) & PACKET_NUMBER_MASK;
+            if (ahead >= SIZE) { received = {}; }
+            for (uint32_t n = next; ahead < SIZE and n != number;
+                n = (n + 1) & PACKET_NUMBER_MASK)
+            {
+                Clear(n);
+            }
+            newest = number;
+            Set(number);
+            return Arrival::Newest;
+        }
+
+        const uint32_t behind = (newest - number) & PACKET_NUMBER_MASK;
+        if (behind >= SIZE) { return Arrival::TooOld; }
+        if (IsSet(number)) { return Arrival::Duplicate; }
+        Set(number);
+        return Arrival::Late;
+    }
+
+private:
+    // The window is a power of 2 dividing the number space, so a number
+    // keeps its bit across wrapping.
+    [[nodiscard]] static uint64_t Bit(uint32_t number) noexcept
+    {
+        return uint64_t{1} << (number % 64);
+    }
+
+    [[nodiscard]] bool IsSet(uint32_t number) const noexcept
+    {
+        return received[number % SIZE / 64] & Bit(number);
+    }
+
+    void Set(uint32_t number) noexcept
+    {
+        received[number % SIZE / 64] |= Bit(number);
+    }
+
+    void Clear(uint32_t number) noexcept
+    {
+        received[number % SIZE / 64] &= ~Bit(number);
+    }
+};
+
+} // namespace ks3::detail
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "std/std_precomp.h"
+#include "platform/msquic_loader.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+using namespace std::chrono;
+
+enum class DuplicateMode : uint8_t
+{
+    Always,   // send every datagram on both connections
+    Adaptive, // send on the better one, and on both when it looks bad
+};
+
+// Every peer is reached through two connections, the one we started (Self)
+// and the one the peer started (Peer). Choose the connections to send each
+// datagram on.
+//
+// We read the RTT and the loss of each connection from msquic every
+// REFRESH_INTERVAL, and prefer the one with the lower RTT. We duplicate
+// while the preferred one loses packets or its RTT spikes over its minimum.
+// A connection stalls when a datagram sent on it has no ack for a few RTTs;
+// then we fail over to the other one at once, and probe the stalled one
+// every REFRESH_INTERVAL to learn when it recovers.
+//
+// Choose() is called on the sending threads, and OnAcknowledged() on msquic
+// worker threads. Only the thread that claims a refresh or a probe does it;
+// the others go on with the values of the last refresh.
+class PathPolicy
+{
+public:
+    static constexpr int SELF = 1;
+    static constexpr int PEER = 2;
+    static constexpr int BOTH = SELF | PEER;
+
+    static constexpr milliseconds REFRESH_INTERVAL = 200ms;
+    static constexpr double DUPLICATE_LOSS = 0.02;
+    static constexpr microseconds RTT_SPIKE_MARGIN = 10ms;
+    static constexpr milliseconds MIN_STALL_TIMEOUT = 50ms;
+    static constexpr int STALL_RTTS = 4;
+
+private:
+    struct Path
+    {
+        // The oldest datagram sent without an ack since, or 0.
+        atomic_int64_t PendingSince{0};
+
+        atomic_uint32_t Rtt = 0;    // in microseconds
+        atomic_uint32_t MinRtt = 0;
+        atomic<double> Loss = 0;    // of the packets, smoothed
+
+        // Only for the thread refreshing.
+        uint64_t TotalPackets = 0;
+        uint64_t LostPackets = 0;
+    };
+
+    array<Path, 2> paths;
+    atomic_int64_t lastRefresh = 0; // ticks of steady_clock
+    atomic_int64_t lastProbe = 0;
+    atomic_int preferred = 0;
+    atomic<DuplicateMode> mode = DuplicateMode::Adaptive;
+
+public:
+    void SetMode(DuplicateMode newMode) noexcept { mode = newMode; }
+    [[nodiscard]] DuplicateMode GetMode() const noexcept { return mode; }
+
+    // Return SELF, PEER or both for the connections that exist.
+    [[nodiscard]] int Choose(
+        HQUIC self,
+        HQUIC peer,
+        steady_clock::time_point now
+        ) noexcept
+    {
+        if (self == nullptr) { return peer == nullptr ? 0 : PEER; }
+        if (peer == nullptr) { return SELF; }
+        if (mode == DuplicateMode::Always) { return BOTH; }
+
+        if (Claim(lastRefresh, now))
+        {
+            Refresh(paths[0], self);
+            Refresh(paths[1], peer);
+        }
+
+        const bool selfStalled = IsStalled(paths[0], now);
+        const bool peerStalled = IsStalled(paths[1], now);
+        if (selfStalled != peerStalled)
+        {
+            if (Claim(lastProbe, now)) { return BOTH; }
+            return selfStalled ? PEER : SELF;
+        }
+        if (selfStalled) { return BOTH; }
+
+        // Switch only to a clearly better one, so that we don't flap.
+        int best = preferred.load(memory_order_relaxed);
+        if (paths[1 - best].Rtt * 5 < paths[best].Rtt * 4)
+        {
+            best = 1 - best;
+            preferred.store(best, memory_order_relaxed);
+        }
+
+        const Path &path = paths[best];
+        const bool spike =
+            path.Rtt > 2 * path.MinRtt + RTT_SPIKE_MARGIN.count();
+        if (path.Loss > DUPLICATE_LOSS or spike) { return BOTH; }
+        return best == 0 ? SELF : PEER;
+    }
+
+    void OnSent(int sentPaths, steady_clock::time_point now) noexcept
+    {
+        const int64_t ticks = now.time_since_epoch().count();
+        for (int i = 0; i < 2; ++i)
+        {
+            if ((sentPaths & (1 << i)) == 0) { continue; }
+            int64_t none = 0;
+            paths[i].PendingSince.compare_exchange_strong(none, ticks,
+                memory_order_relaxed);
+        }
+    }
+
+    // The loss of the packets on the preferred connection.
+    [[nodiscard]] double GetLoss() const noexcept
+    {
+        return paths[preferred.load(memory_order_relaxed)].Loss;
+    }
+
+    // A datagram sent on the path (SELF or PEER) is acknowledged.
+    void OnAcknowledged(int path) noexcept
+    {
+        paths[path == SELF ? 0 : 1].PendingSince.store(0,
+            memory_order_relaxed);
+    }
+
+    // The connections are gone, and so are the datagrams pending on them.
+    void Reset() noexcept
+    {
+        OnAcknowledged(SELF);
+        OnAcknowledged(PEER);
+    }
+
+private:
+    // Return true for the one thread that finds REFRESH_INTERVAL passed
+    // since the last time, and sets it to now.
+    [[nodiscard]] static bool Claim(
+        atomic_int64_t &last,
+        steady_clock::time_point now
+        ) noexcept
+    {
+        const int64_t ticks = now.time_since_epoch().count();
+        int64_t previous = last.load(memory_order_relaxed);
+        const steady_clock::time_point since{
+            steady_clock::duration{previous}};
+        if (now - since < REFRESH_INTERVAL) { return false; }
+        return last.compare_exchange_strong(previous, ticks,
+            memory_order_acq_rel, memory_order_relaxed);
+    }
+
+    static void Refresh(Path &path, HQUIC conn) noexcept
+    {
+        QUIC_STATISTICS_V2 stats{};
+        uint32_t size = sizeof(stats);
+        QUIC_STATUS status = MsQuic->GetParam(
+            conn, QUIC_PARAM_CONN_STATISTICS_V2, &size, &stats);
+        if (QUIC_FAILED(status)) { return; }
+
+        path.Rtt = stats.Rtt;
+        path.MinRtt = stats.MinRtt;
+
+        const uint64_t lost =
+            stats.SendSuspectedLostPackets - stats.SendSpuriousLostPackets;
+        if (stats.SendTotalPackets > path.TotalPackets and
+            lost >= path.LostPackets)
+        {
+            const double sample = (double)(lost - path.LostPackets) /
+                (double)(stats.SendTotalPackets - path.TotalPackets);
+            const double loss = path.Loss;
+            path.Loss = loss + (min(sample, 1.0) - loss) / 4;
+        }
+        path.TotalPackets = stats.SendTotalPackets;
+        path.LostPackets = lost;
+    }
+
+    [[nodiscard]] static bool IsStalled(
+        const Path &path,
+        steady_clock::time_point now
+        ) noexcept
+    {
+        const int64_t pending = path.PendingSince.load(memory_order_relaxed);
+        if (pending == 0) { return false; }
+
+        const steady_clock::duration timeout = max<steady_clock::duration>(
+            MIN_STALL_TIMEOUT, microseconds{path.Rtt} * STALL_RTTS);
+        const steady_clock::time_point since{steady_clock::duration{pending}};
+        return now - since > timeout;
+    }
+};
+
+} // namespace ks3::detail
@@ -62,6 +62,27 @@ namespace ks3::detail
     SOCKET InternalGetSocketFromConnection(HQUIC hconn) noexcept;
     SOCKET InternalGetSocketFromListener(HQUIC hlisn) noexcept;
     std::filesystem::path GetTempDirectoryPath(std::error_code &) noexcept;
+
+    // A file mapped into memory with the native handles to release it.
+    struct MappedFile
+    {
+        uint8_t *Data = nullptr;
+        size_t Size = 0;
+        intptr_t File = -1;
+        intptr_t Mapping = -1;
+    };
+
+    // Map a file for writing, created if not exists and resized to `size`,
+    // or map a whole existing file for reading.
+    bool MapFile(const std::filesystem::path &, size_t size, bool writable,
+        MappedFile &) noexcept;
+
+    // Start writing the dirty pages back without waiting for them.
+    void FlushMappedFile(MappedFile &) noexcept;
+
+    // Unmap and close the file. A file mapped for writing can be truncated
+    // to the size of its content.
+    void UnmapFile(MappedFile &, std::optional<size_t> truncateTo) noexcept;
 }
 
 #include "koisyn_platform-impl.h"
@@ -74,6 +74,11 @@ inline QUIC_SETTINGS MakeClientSettings() noexcept
     settings.PacingEnabled = False;
     settings.IsSet.PacingEnabled = True;
 
+    // Complete sends once acked rather than once copied, so that the send
+    // budget from QUIC_STREAM_EVENT_IDEAL_SEND_BUFFER_SIZE measures the network
+    settings.SendBufferingEnabled = False;
+    settings.IsSet.SendBufferingEnabled = True;
+
     // Enable unreliable sending
     settings.DatagramReceiveEnabled = True;
     settings.IsSet.DatagramReceiveEnabled = True;
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+inline bool MapFile(
+    const filesystem::path &path,
+    size_t size,
+    bool writable,
+    MappedFile &mapped
+    ) noexcept
+{
+    int fd = open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) { return false; }
+
+    if (writable)
+    {
+        if (ftruncate(fd, (off_t)size) != 0)
+        {
+            close(fd);
+            return false;
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 or st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+    }
+
+    void *view = mmap(nullptr, size,
+        writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    mapped.Data = (uint8_t *)view;
+    mapped.Size = size;
+    mapped.File = fd;
+    mapped.Mapping = -1;
+    return true;
+}
+
+inline void FlushMappedFile(MappedFile &mapped) noexcept
+{
+    if (mapped.Data == nullptr) { return; }
+    msync(mapped.Data, mapped.Size, MS_ASYNC);
+}
+
+inline void UnmapFile(MappedFile &mapped, optional<size_t> truncateTo)
+    noexcept
+{
+    if (mapped.Data == nullptr) { return; }
+    munmap(mapped.Data, mapped.Size);
+    if (truncateTo) { (void)ftruncate((int)mapped.File, (off_t)*truncateTo); }
+    close((int)mapped.File);
+    mapped = {};
+}
+
+} // namespace ks3::detail
@@ -0,0 +1,93 @@
+#pragma once
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+inline bool MapFile(
+    const filesystem::path &path,
+    size_t size,
+    bool writable,
+    MappedFile &mapped
+    ) noexcept
+{
+    HANDLE file = CreateFileW(
+        path.c_str(),
+        writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr,
+        writable ? OPEN_ALWAYS : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE) { return false; }
+
+    if (not writable)
+    {
+        LARGE_INTEGER fileSize;
+        if (not GetFileSizeEx(file, &fileSize) or fileSize.QuadPart == 0)
+        {
+            CloseHandle(file);
+            return false;
+        }
+        size = (size_t)fileSize.QuadPart;
+    }
+
+    // The file grows to the size of the mapping.
+    HANDLE mapping = CreateFileMappingW(
+        file,
+        nullptr,
+        writable ? PAGE_READWRITE : PAGE_READONLY,
+        (DWORD)((uint64_t)size >> 32),
+        (DWORD)size,
+        nullptr);
+    if (mapping == nullptr)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    void *view = MapViewOfFile(
+        mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+    if (view == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    mapped.Data = (uint8_t *)view;
+    mapped.Size = size;
+    mapped.File = (intptr_t)file;
+    mapped.Mapping = (intptr_t)mapping;
+    return true;
+}
+
+inline void FlushMappedFile(MappedFile &mapped) noexcept
+{
+    if (mapped.Data == nullptr) { return; }
+    FlushViewOfFile(mapped.Data, 0);
+}
+
+inline void UnmapFile(MappedFile &mapped, optional<size_t> truncateTo)
+    noexcept
+{
+    if (mapped.Data == nullptr) { return; }
+    UnmapViewOfFile(mapped.Data);
+    CloseHandle((HANDLE)mapped.Mapping);
+
+    // The file can't be truncated while it is mapped.
+    if (truncateTo)
+    {
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG)*truncateTo;
+        if (SetFilePointerEx((HANDLE)mapped.File, end, nullptr, FILE_BEGIN))
+        {
+            SetEndOfFile((HANDLE)mapped.File);
+        }
+    }
+    CloseHandle((HANDLE)mapped.File);
+    mapped = {};
+}
+
+} // namespace ks3::detail
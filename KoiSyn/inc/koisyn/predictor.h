@@ -0,0 +1,145 @@
+#pragma once
+
+#include "std/std_precomp.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// A predictor guesses the fixed part of a missing remote input. The engine
+// keeps one predictor per player, feeds it with every confirmed input of
+// that player in frame order, and asks it when an input is missing. The
+// dynamic part of a predicted input is always the last confirmed one.
+//
+// Observe(confirmed): an input is confirmed, in frame order.
+// Predict(last, out): the last confirmed input; write the prediction to out.
+//
+// A better prediction means fewer and shallower rollbacks, but a prediction
+// never affects the correctness of the simulation.
+template <typename P, int FixedSize>
+concept ConceptInputPredictor =
+    default_initializable<P> &&
+    requires (
+        P p,
+        const array<uint8_t, FixedSize> &in,
+        array<uint8_t, FixedSize> &out)
+    {
+        { p.Observe(in) } noexcept;
+        { p.Predict(in, out) } noexcept;
+    };
+
+// The player keeps pressing the same buttons. It is the right choice for most
+// games, where inputs seldom change between frames.
+template <int FixedSize>
+struct RepeatLastPredictor
+{
+    void Observe(const array<uint8_t, FixedSize> &) noexcept {}
+
+    void Predict(
+        const array<uint8_t, FixedSize> &last,
+        array<uint8_t, FixedSize> &out
+        ) noexcept
+    {
+        out = last;
+    }
+};
+
+// The player releases all buttons. Fits the games whose inputs are mostly
+// impulses e.g. a click.
+template <int FixedSize>
+struct NeutralPredictor
+{
+    void Observe(const array<uint8_t, FixedSize> &) noexcept {}
+
+    void Predict(
+        const array<uint8_t, FixedSize> &,
+        array<uint8_t, FixedSize> &out
+        ) noexcept
+    {
+        out = {};
+    }
+};
+
+// An online model for every byte of the input. We count how often a byte
+// keeps its value against how often it changes, and keep the most frequent
+// values with the space-saving algorithm in a tiny table. If the byte usually
+// stays, we repeat it; otherwise we predict the most frequent other value.
+// Counts are halved when saturated so that the model follows the player.
+template <int FixedSize, int TableSize = 4>
+    requires (TableSize > 0)
+struct FrequencyPredictor
+{
+private:
+    static constexpr uint16_t saturation = 1024;
+
+    struct ByteModel
+    {
+        array<uint8_t, TableSize> Values{};
+        array<uint16_t, TableSize> Counts{};
+        uint16_t Stay = 0;
+        uint16_t Change = 0;
+        uint8_t Last = 0;
+    };
+
+    array<ByteModel, FixedSize> models{};
+
+public:
+    void Observe(const array<uint8_t, FixedSize> &in) noexcept
+    {
+        for (int i = 0; i < FixedSize; ++i)
+        {
+            ByteModel &m = models[i];
+            const uint8_t value = in[i];
+
+            if (value == m.Last) { ++m.Stay; }
+            else { ++m.Change; }
+            m.Last = value;
+
+            // Find the value, or replace the least frequent one.
+            int found = 0;
+            for (int j = 0; j < TableSize; ++j)
+            {
+                if (m.Values[j] == value) { found = j; break; }
+                if (m.Counts[j] < m.Counts[found]) { found = j; }
+            }
+            m.Values[found] = value;
+            ++m.Counts[found];
+
+            if (m.Counts[found] >= saturation or
+                m.Stay >= saturation or
+                m.Change >= saturation)
+            {
+                for (uint16_t &c : m.Counts) { c >>= 1; }
+                m.Stay >>= 1;
+                m.Change >>= 1;
+            }
+        }
+    }
+
+    void Predict(
+        const array<uint8_t, FixedSize> &last,
+        array<uint8_t, FixedSize> &out
+        ) noexcept
+    {
+        for (int i = 0; i < FixedSize; ++i)
+        {
+            const ByteModel &m = models[i];
+            out[i] = last[i];
+            if (m.Stay >= m.Change) { continue; }
+
+            uint16_t best = 0;
+            for (int j = 0; j < TableSize; ++j)
+            {
+                if (m.Values[j] == last[i]) { continue; }
+                if (m.Counts[j] > best)
+                {
+                    best = m.Counts[j];
+                    out[i] = m.Values[j];
+                }
+            }
+        }
+    }
+};
+
+} // namespace ks3::detail
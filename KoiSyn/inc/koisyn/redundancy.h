@@ -0,0 +1,121 @@
+#pragma once
+
+#include "std/std_precomp.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+using namespace std::chrono;
+
+// Decide which of our recent inputs to send to every peer, so that a lost
+// datagram is covered by the next one instead of stalling the peer.
+//
+// Every input packet carries the newest K frames of our input, and tells the
+// peer which of its inputs we have (the ack) and how many of its packets we
+// have lost. We send one packet per frame with the newest frame increased by
+// one, so a jump of the newest frame in the packets of a peer means the
+// packets between are lost. K follows the loss the peer reports: we pick the
+// smallest K that makes losing K packets in a row unlikely.
+//
+// Frames not acked after a round trip are presumably lost beyond the window
+// (e.g. a long burst), so we send them all again until they are acked.
+template <int NumPlayers>
+class RedundancyWindow
+{
+public:
+    static constexpr int MIN_REDUNDANCY = 2;
+    static constexpr int MAX_REDUNDANCY = 16;
+
+    // Never send more frames than this in a packet.
+    static constexpr int MAX_FRAMES = 64;
+
+    // We aim at losing a frame less than once in this many frames.
+    static constexpr double TARGET_LOSS = 1e-3;
+
+private:
+    struct Peer
+    {
+        int32_t Acked = -1;           // the peer has our inputs up to it
+        int32_t Newest = -1;          // the newest frame from the peer
+        double Loss = 0;              // of the packets from the peer
+        uint8_t ReportedLoss = 0;     // of our packets, by the peer
+    };
+
+    array<Peer, NumPlayers> peers{};
+
+public:
+    void Reset(int player) noexcept
+    {
+        peers[player] = {};
+    }
+
+    // An input packet from the player.
+    void OnPacket(int player, int32_t ack, uint8_t loss, int32_t newest)
+        noexcept
+    {
+        Peer &peer = peers[player];
+        peer.Acked = max(peer.Acked, ack);
+        peer.ReportedLoss = loss;
+
+        // Late or repeated packets tell nothing about the loss.
+        if (newest <= peer.Newest) { return; }
+        if (peer.Newest != -1)
+        {
+            // exponential moving average over packets, alpha = 1/16
+            const int32_t lost = min(newest - peer.Newest - 1, MAX_FRAMES);
+            for (int32_t i = 0; i < lost; ++i)
+            {
+                peer.Loss += (1 - peer.Loss) / 16;
+            }
+            peer.Loss -= peer.Loss / 16;
+        }
+        peer.Newest = newest;
+    }
+
+    // The loss of the player's packets to report to it.
+    [[nodiscard]] uint8_t GetLossReport(int player) const noexcept
+    {
+        return (uint8_t)min(peers[player].Loss * 256, 255.0);
+    }
+
+    [[nodiscard]] int32_t GetAcked(int player) const noexcept
+    {
+        return peers[player].Acked;
+    }
+
+    // K for the packets to the player.
+    [[nodiscard]] int GetRedundancy(int player) const noexcept
+    {
+        const double loss = peers[player].ReportedLoss / 256.0;
+        if (loss <= 0) { return MIN_REDUNDANCY; }
+
+        // loss ^ K <= TARGET_LOSS
+        const double k = ceil(log(TARGET_LOSS) / log(loss));
+        return (int)clamp(k, (double)MIN_REDUNDANCY, (double)MAX_REDUNDANCY);
+    }
+
+    // The first frame to send to the player with the newest frame. The
+    // frames in flight for a round trip (plus a frame) are not acked yet
+    // even if received.
+    [[nodiscard]] int32_t GetFirstFrame(
+        int player,
+        int32_t newest,
+        optional<microseconds> rtt,
+        int frameRate
+        ) const noexcept
+    {
+        const int32_t acked = peers[player].Acked;
+        int32_t first = newest - GetRedundancy(player) + 1;
+        if (rtt)
+        {
+            const double seconds = rtt->count() / 1e6;
+            const int32_t inFlight = (int32_t)ceil(seconds * frameRate) + 1;
+            if (acked < newest - inFlight) { first = acked + 1; }
+        }
+        first = max(first, acked + 1);
+        return max(first, newest - MAX_FRAMES + 1);
+    }
+};
+
+} // namespace ks3::detail
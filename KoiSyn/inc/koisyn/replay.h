@@ -0,0 +1,768 @@
+#pragma once
+
+#include "std/std_precomp.h"
+#include "platform/koisyn_platform.h"
+#include "ring_queue.h"
+#include "koisyn.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// A state is saved in a replay as its bytes if it is trivially copyable.
+// Otherwise, it should provide:
+//
+// Serialize(out): write the state to out and return the size written, or 0
+// if out is too small.
+// Deserialize(in): load the state written by Serialize.
+template <typename State>
+concept ConceptReplayableState =
+    is_trivially_copyable_v<State> ||
+    requires (State a, const State b, span<uint8_t> out, span<const uint8_t> in)
+    {
+        { b.Serialize(out) } noexcept -> same_as<size_t>;
+        { a.Deserialize(in) } noexcept -> same_as<bool>;
+    };
+
+// Replay file:
+//
+// Header (64 bytes, big endian):
+// [magic "KSRP"] [version: 4] [players: 4] [fixed size: 4] [dynamic: 4]
+// [keyframe interval: 4] [frames: 4] [keyframes: 4] [data end: 8]
+// [index offset: 8] [reserved: 16]
+//
+// Then the records, appended in the order they are written:
+// Frame:    [0] [frame: 4] [size: 2] [inputs]
+// Keyframe: [1] [frame: 4] [size: 4] [serialized state]
+// The inputs of every player: [fixed part] and, if the input has a dynamic
+// part, [size: 2] [dynamic part].
+//
+// A keyframe is the state at the beginning of a frame, every `interval`
+// frames. It may be written after some frame records following it, so the
+// index at the end tells where the keyframe and the record of its frame are:
+// Index entry: [frame: 4] [keyframe offset: 8] [frame offset: 8]
+//
+// The header is updated as we write, so if the recording is not closed
+// properly, the reader finds the index offset 0 and scans the records up to
+// the data end instead.
+struct ReplayFormat
+{
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t HEADER_SIZE = 64;
+    static constexpr size_t FRAME_HEADER_SIZE = 1 + 4 + 2;
+    static constexpr size_t KEYFRAME_HEADER_SIZE = 1 + 4 + 4;
+    static constexpr size_t INDEX_ENTRY_SIZE = 4 + 8 + 8;
+
+    enum Offset : size_t
+    {
+        Magic = 0,
+        Version = 4,
+        Players = 8,
+        FixedSize = 12,
+        Dynamic = 16,
+        KeyframeInterval = 20,
+        Frames = 24,
+        Keyframes = 28,
+        DataEnd = 32,
+        IndexOffset = 40,
+    };
+
+    enum Kind : uint8_t { FrameRecord = 0, KeyframeRecord = 1 };
+
+    struct IndexEntry
+    {
+        uint64_t KeyframeOffset = 0;
+        uint64_t FrameOffset = 0;
+    };
+
+    static constexpr array<uint8_t, 4> MAGIC = {'K', 'S', 'R', 'P'};
+};
+
+// Record the confirmed frames of a match into a file.
+//
+// The engine pushes every confirmed frame and a keyframe every `interval`
+// frames into lock-free queues, which is just a copy; a worker thread
+// encodes them into a memory-mapped file, so the game thread never waits for
+// the disk and never allocates. If the worker falls behind and a queue is
+// full, the recording stops there and IsFailed() returns true. The file
+// stays readable up to the last frame written.
+template <ConceptGameState State>
+class ReplayWriter
+{
+    static_assert(ConceptReplayableState<State>,
+        "the state must be trivially copyable or provide Serialize and "
+        "Deserialize to be saved in a replay");
+
+public:
+    using Input = InputFor<State>;
+
+    static constexpr int NUM_PLAYERS = State::MAX_NUM_PLAYERS;
+    static constexpr int MAX_DYNAMIC_SIZE = GetMaxDynamicInputSize<State>();
+    static constexpr size_t MAX_FRAME_SIZE = NUM_PLAYERS *
+        (Input::FIXED_SIZE + (Input::DYNAMIC_SIZE ? 2 + MAX_DYNAMIC_SIZE : 0));
+
+    static constexpr int DEFAULT_KEYFRAME_INTERVAL = 600;
+    static constexpr size_t FRAME_QUEUE_SIZE = 256;
+    static constexpr size_t KEYFRAME_QUEUE_SIZE = 4;
+
+    // How often the worker writes the queued frames.
+    static constexpr milliseconds WRITE_INTERVAL = 16ms;
+
+private:
+    struct QueuedFrame
+    {
+        int32_t Frame = 0;
+        uint16_t Size = 0;
+        array<uint8_t, MAX_FRAME_SIZE> Data;
+    };
+
+    struct QueuedKeyframe
+    {
+        int32_t Frame = 0;
+        State Saved{};
+    };
+
+    using Format = ReplayFormat;
+
+    int keyframeInterval;
+    unique_ptr<SpscRingQueue<QueuedFrame, FRAME_QUEUE_SIZE>> frames;
+    unique_ptr<SpscRingQueue<QueuedKeyframe, KEYFRAME_QUEUE_SIZE>> keyframes;
+    atomic_bool failed = false;
+
+    // Accessed by the game thread only.
+    int32_t nextFrame = 0;
+
+    // Accessed by the worker only, or after it stops. Everything queued
+    // before a push failed is still written.
+    bool writeFailed = false;
+    filesystem::path path;
+    MappedFile file;
+    size_t end = 0;
+    int32_t framesWritten = 0;
+    vector<Format::IndexEntry> index;
+
+    condition_variable stopSignal;
+    mutex stopMutex;
+    bool stopping = false;
+    thread worker;
+
+public:
+    explicit ReplayWriter(int keyframeInterval = DEFAULT_KEYFRAME_INTERVAL)
+        noexcept :
+        keyframeInterval{max(keyframeInterval, 1)}
+    {
+    }
+
+    ReplayWriter(const ReplayWriter &) = delete;
+    void operator=(const ReplayWriter &) = delete;
+
+    ~ReplayWriter() noexcept
+    {
+        Close();
+    }
+
+    // Create the file and start the worker. The file grows from
+    // `initialSize` as needed.
+    bool Open(const filesystem::path &filePath, size_t initialSize = 1 << 20)
+        noexcept
+    try
+    {
+        if (worker.joinable()) { return false; }
+
+        frames.reset(new(nothrow) SpscRingQueue<QueuedFrame, FRAME_QUEUE_SIZE>);
+        keyframes.reset(
+            new(nothrow) SpscRingQueue<QueuedKeyframe, KEYFRAME_QUEUE_SIZE>);
+        if (not frames or not keyframes) [[unlikely]] { return false; }
+
+        path = filePath;
+        initialSize = max(initialSize, Format::HEADER_SIZE);
+        if (not MapFile(path, initialSize, true, file)) { return false; }
+
+        index.clear();
+        index.reserve(256);
+        end = Format::HEADER_SIZE;
+        framesWritten = 0;
+        nextFrame = 0;
+        failed = false;
+        writeFailed = false;
+        stopping = false;
+
+        uint8_t *header = file.Data;
+        memset(header, 0, Format::HEADER_SIZE);
+        memcpy(header + Format::Magic, Format::MAGIC.data(), 4);
+        StoreU32BE(header + Format::Version, Format::VERSION);
+        StoreU32BE(header + Format::Players, NUM_PLAYERS);
+        StoreU32BE(header + Format::FixedSize, Input::FIXED_SIZE);
+        StoreU32BE(header + Format::Dynamic, Input::DYNAMIC_SIZE);
+        StoreU32BE(header + Format::KeyframeInterval, keyframeInterval);
+        UpdateHeader();
+
+        worker = thread{&ReplayWriter::Work, this};
+        return true;
+    }
+    catch (...)
+    {
+        if (file.Data != nullptr) { UnmapFile(file, nullopt); }
+        return false;
+    }
+
+    // Write what is still queued and the index, and close the file. The
+    // engine must not push any more.
+    void Close() noexcept
+    {
+        if (not worker.joinable()) { return; }
+        {
+            lock_guard _{stopMutex};
+            stopping = true;
+        }
+        stopSignal.notify_all();
+        worker.join();
+
+        WriteQueued();
+        WriteIndex();
+        FlushMappedFile(file);
+        UnmapFile(file, end);
+    }
+
+    [[nodiscard]] int GetKeyframeInterval() const noexcept
+    {
+        return keyframeInterval;
+    }
+
+    [[nodiscard]] bool IsFailed() const noexcept { return failed; }
+
+    // Called by the engine on the game thread. The frames must be pushed in
+    // order from 0.
+    bool PushFrame(int32_t frame, span<const Input> inputs) noexcept
+    {
+        if (failed or inputs.size() != NUM_PLAYERS) { return false; }
+        if (frame != nextFrame) [[unlikely]] { failed = true; return false; }
+
+        bool pushed = frames->TryProduce([&](QueuedFrame &slot) noexcept
+        {
+            uint8_t *out = slot.Data.data();
+            for (const Input &input : inputs)
+            {
+                if constexpr (Input::FIXED_SIZE > 0)
+                {
+                    memcpy(out, input.fixed.data(), Input::FIXED_SIZE);
+                    out += Input::FIXED_SIZE;
+                }
+                if constexpr (Input::DYNAMIC_SIZE)
+                {
+                    const size_t size = min(input.dyn.size(),
+                        (size_t)MAX_DYNAMIC_SIZE);
+                    const uint16_t beSize = htons((uint16_t)size);
+                    memcpy(out, &beSize, 2);
+                    out += 2;
+                    if (size != 0) { memcpy(out, input.dyn.data(), size); }
+                    out += size;
+                }
+            }
+            slot.Frame = frame;
+            slot.Size = (uint16_t)(out - slot.Data.data());
+            return true;
+        });
+        if (not pushed) [[unlikely]] { failed = true; return false; }
+
+        ++nextFrame;
+        return true;
+    }
+
+    // Called by the engine on the game thread with the confirmed state at
+    // the beginning of the frame.
+    bool PushKeyframe(int32_t frame, const State &state) noexcept
+    {
+        if (failed) { return false; }
+        bool pushed = keyframes->TryProduce(
+            [&](QueuedKeyframe &slot) noexcept
+            {
+                slot.Frame = frame;
+                slot.Saved = state;
+                return true;
+            });
+        if (not pushed) [[unlikely]] { failed = true; }
+        return pushed;
+    }
+
+private:
+    void Work() noexcept
+    {
+        while (true)
+        {
+            {
+                unique_lock lk{stopMutex};
+                bool stopNow = stopSignal.wait_for(
+                    lk, WRITE_INTERVAL, [&] { return stopping; });
+                if (stopNow) { return; }
+            }
+            WriteQueued();
+        }
+    }
+
+    void WriteQueued() noexcept
+    {
+        keyframes->Drain([&](QueuedKeyframe &keyframe) noexcept
+        {
+            if (not writeFailed) { WriteKeyframe(keyframe); }
+        });
+        frames->Drain([&](QueuedFrame &frame) noexcept
+        {
+            if (not writeFailed) { WriteFrame(frame); }
+        });
+        UpdateHeader();
+    }
+
+    // Make room for `size` more bytes, remapping a larger file if needed.
+    bool Reserve(size_t size) noexcept
+    {
+        if (end + size <= file.Size) { return true; }
+
+        const size_t newSize = max(file.Size * 2, end + size);
+        UnmapFile(file, nullopt);
+        if (not MapFile(path, newSize, true, file)) [[unlikely]]
+        {
+            writeFailed = true;
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    Format::IndexEntry *GetIndexEntry(int32_t frame) noexcept
+    try
+    {
+        const size_t i = (size_t)(frame / keyframeInterval);
+        if (i >= index.size()) { index.resize(i + 1); }
+        return &index[i];
+    }
+    catch (...)
+    {
+        writeFailed = true;
+        failed = true;
+        return nullptr;
+    }
+
+    void WriteFrame(const QueuedFrame &frame) noexcept
+    {
+        if (not Reserve(Format::FRAME_HEADER_SIZE + frame.Size)) { return; }
+
+        if (frame.Frame % keyframeInterval == 0)
+        {
+            Format::IndexEntry *entry = GetIndexEntry(frame.Frame);
+            if (entry == nullptr) [[unlikely]] { return; }
+            entry->FrameOffset = end;
+        }
+
+        uint8_t *out = file.Data + end;
+        const uint16_t beSize = htons(frame.Size);
+        out[0] = Format::FrameRecord;
+        StoreU32BE(out + 1, (uint32_t)frame.Frame);
+        memcpy(out + 5, &beSize, 2);
+        memcpy(out + Format::FRAME_HEADER_SIZE, frame.Data.data(), frame.Size);
+        end += Format::FRAME_HEADER_SIZE + frame.Size;
+        framesWritten = frame.Frame + 1;
+    }
+
+    void WriteKeyframe(const QueuedKeyframe &keyframe) noexcept
+    {
+        if (keyframe.Frame % keyframeInterval != 0) [[unlikely]] { return; }
+
+        size_t size;
+        if constexpr (is_trivially_copyable_v<State>)
+        {
+            size = sizeof(State);
+            if (not Reserve(Format::KEYFRAME_HEADER_SIZE + size)) { return; }
+            memcpy(file.Data + end + Format::KEYFRAME_HEADER_SIZE,
+                &keyframe.Saved, size);
+        }
+        else
+        {
+            // We don't know the size until it is serialized, so we grow the
+            // file until it fits.
+            if (not Reserve(Format::KEYFRAME_HEADER_SIZE + 4096)) { return; }
+            while (true)
+            {
+                const size_t offset = end + Format::KEYFRAME_HEADER_SIZE;
+                size = keyframe.Saved.Serialize(
+                    span{file.Data + offset, file.Size - offset});
+                if (size != 0) { break; }
+                if (not Reserve(file.Size)) { return; }
+            }
+        }
+
+        Format::IndexEntry *entry = GetIndexEntry(keyframe.Frame);
+        if (entry == nullptr) [[unlikely]] { return; }
+        entry->KeyframeOffset = end;
+
+        uint8_t *out = file.Data + end;
+        out[0] = Format::KeyframeRecord;
+        StoreU32BE(out + 1, (uint32_t)keyframe.Frame);
+        StoreU32BE(out + 5, (uint32_t)size);
+        end += Format::KEYFRAME_HEADER_SIZE + size;
+    }
+
+    void WriteIndex() noexcept
+    {
+        if (writeFailed) { return; }
+
+        // Only the keyframes with the record of its frame are usable.
+        size_t count = 0;
+        for (const Format::IndexEntry &entry : index)
+        {
+            count += entry.KeyframeOffset != 0 and entry.FrameOffset != 0;
+        }
+        if (not Reserve(count * Format::INDEX_ENTRY_SIZE)) { return; }
+
+        const size_t indexOffset = end;
+        for (size_t i = 0; i < index.size(); ++i)
+        {
+            const Format::IndexEntry &entry = index[i];
+            if (entry.KeyframeOffset == 0 or entry.FrameOffset == 0)
+            {
+                continue;
+            }
+            uint8_t *out = file.Data + end;
+            StoreU32BE(out, (uint32_t)(i * keyframeInterval));
+            StoreU64BE(out + 4, entry.KeyframeOffset);
+            StoreU64BE(out + 12, entry.FrameOffset);
+            end += Format::INDEX_ENTRY_SIZE;
+        }
+
+        UpdateHeader();
+        StoreU32BE(file.Data + Format::Keyframes, (uint32_t)count);
+        StoreU64BE(file.Data + Format::IndexOffset, indexOffset);
+    }
+
+    // The data end is written last, so a reader never sees a record that is
+    // not completely written.
+    void UpdateHeader() noexcept
+    {
+        if (file.Data == nullptr) { return; }
+        StoreU32BE(file.Data + Format::Frames, (uint32_t)framesWritten);
+        atomic_thread_fence(memory_order_release);
+        StoreU64BE(file.Data + Format::DataEnd, end);
+    }
+};
+
+// Play a replay file, and seek to any frame by loading the nearest keyframe
+// before it and simulating from there, so a seek costs at most one keyframe
+// interval of simulation.
+template <ConceptGameState State>
+class ReplayReader
+{
+    static_assert(ConceptReplayableState<State>,
+        "the state must be trivially copyable or provide Serialize and "
+        "Deserialize to be loaded from a replay");
+
+public:
+    using Input = InputFor<State>;
+
+    static constexpr int NUM_PLAYERS = State::MAX_NUM_PLAYERS;
+
+private:
+    using Format = ReplayFormat;
+
+    struct Keyframe
+    {
+        int32_t Frame;
+        Format::IndexEntry Entry;
+    };
+
+    MappedFile file;
+    size_t dataEnd = 0;
+    int32_t frameCount = 0;
+    int keyframeInterval = 1;
+    vector<Keyframe> keyframes;
+
+    State state{};
+    int32_t currentFrame = 0; // the next frame to simulate
+    size_t cursor = 0;        // the record of the next frame, or after it
+    array<Input, NUM_PLAYERS> frameInputs;
+
+public:
+    ReplayReader() noexcept = default;
+    ReplayReader(const ReplayReader &) = delete;
+    void operator=(const ReplayReader &) = delete;
+
+    ~ReplayReader() noexcept
+    {
+        Close();
+    }
+
+    // Open the file and load the state at frame 0.
+    bool Open(const filesystem::path &path) noexcept
+    try
+    {
+        Close();
+        if (not MapFile(path, 0, false, file)) { return false; }
+        if (not ReadHeader() or not ReadIndex() or not Seek(0))
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+    catch (...)
+    {
+        Close();
+        return false;
+    }
+
+    void Close() noexcept
+    {
+        UnmapFile(file, nullopt);
+        keyframes.clear();
+        frameCount = 0;
+    }
+
+    // The number of frames recorded. We can seek to frame 0 to this.
+    [[nodiscard]] int32_t GetFrameCount() const noexcept { return frameCount; }
+
+    // The next frame to simulate.
+    [[nodiscard]] int32_t GetFrame() const noexcept { return currentFrame; }
+
+    // The state at the beginning of the current frame.
+    [[nodiscard]] const State &GetState() const noexcept { return state; }
+
+    // Load the state at the beginning of the frame.
+    bool Seek(int32_t frame) noexcept
+    {
+        if (frame < 0 or frame > frameCount) { return false; }
+
+        // Keep going if the frame is ahead within the keyframe interval.
+        const bool near = frame >= currentFrame and
+            frame - currentFrame < keyframeInterval and cursor != 0;
+        if (not near)
+        {
+            auto it = ranges::upper_bound(keyframes, frame, {},
+                [](const Keyframe &k) { return k.Frame; });
+            if (it == keyframes.begin()) [[unlikely]] { return false; }
+            --it;
+            if (not LoadKeyframe(it->Entry.KeyframeOffset)) { return false; }
+            currentFrame = it->Frame;
+            cursor = it->Entry.FrameOffset;
+        }
+
+        while (currentFrame < frame)
+        {
+            if (not Step()) { return false; }
+        }
+        return true;
+    }
+
+    // Simulate the current frame with the recorded inputs.
+    bool Step() noexcept
+    {
+        if (currentFrame >= frameCount) { return false; }
+
+        optional<span<const uint8_t>> record = FindFrame(currentFrame);
+        if (not record) [[unlikely]] { return false; }
+        if (not DecodeFrame(*record)) [[unlikely]] { return false; }
+
+        state.Advance(span<const Input>{frameInputs});
+        ++currentFrame;
+        return true;
+    }
+
+private:
+    bool ReadHeader() noexcept
+    {
+        if (file.Size < Format::HEADER_SIZE) { return false; }
+        const uint8_t *header = file.Data;
+        if (memcmp(header + Format::Magic, Format::MAGIC.data(), 4) != 0)
+        {
+            return false;
+        }
+        if (LoadU32BE(header + Format::Version) != Format::VERSION or
+            LoadU32BE(header + Format::Players) != NUM_PLAYERS or
+            LoadU32BE(header + Format::FixedSize) != Input::FIXED_SIZE or
+            LoadU32BE(header + Format::Dynamic) != Input::DYNAMIC_SIZE)
+        {
+            return false;
+        }
+
+        keyframeInterval = (int)LoadU32BE(header + Format::KeyframeInterval);
+        frameCount = (int32_t)LoadU32BE(header + Format::Frames);
+        dataEnd = LoadU64BE(header + Format::DataEnd);
+        if (keyframeInterval <= 0 or frameCount < 0) { return false; }
+        if (dataEnd < Format::HEADER_SIZE or dataEnd > file.Size)
+        {
+            return false;
+        }
+        return true;
+    }
+
+    bool ReadIndex()
+    {
+        keyframes.clear();
+        const uint64_t indexOffset = LoadU64BE(file.Data + Format::IndexOffset);
+        if (indexOffset != 0)
+        {
+            // Written so that a crafted count or offset can't overflow.
+            const size_t count = LoadU32BE(file.Data + Format::Keyframes);
+            if (indexOffset < Format::HEADER_SIZE or indexOffset > file.Size or
+                count > (file.Size - indexOffset) / Format::INDEX_ENTRY_SIZE)
+            {
+                return false;
+            }
+            keyframes.reserve(count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                const uint8_t *in =
+                    file.Data + indexOffset + i * Format::INDEX_ENTRY_SIZE;
+                const Format::IndexEntry entry{
+                    LoadU64BE(in + 4), LoadU64BE(in + 12)};
+                if (not IsRecordOffset(entry.KeyframeOffset) or
+                    not IsRecordOffset(entry.FrameOffset))
+                {
+                    return false;
+                }
+                keyframes.push_back({(int32_t)LoadU32BE(in), entry});
+            }
+            return true;
+        }
+
+        // Not closed properly; find the keyframes by scanning the records.
+        vector<Format::IndexEntry> found;
+        size_t offset = Format::HEADER_SIZE;
+        while (offset < dataEnd)
+        {
+            optional<size_t> size = GetRecordSize(offset);
+            if (not size) { return false; }
+
+            const int32_t frame = (int32_t)LoadU32BE(file.Data + offset + 1);
+            if (frame >= 0 and frame % keyframeInterval == 0)
+            {
+                const size_t i = frame / keyframeInterval;
+                if (i >= found.size()) { found.resize(i + 1); }
+                if (file.Data[offset] == Format::KeyframeRecord)
+                {
+                    found[i].KeyframeOffset = offset;
+                }
+                else { found[i].FrameOffset = offset; }
+            }
+            offset += *size;
+        }
+
+        for (size_t i = 0; i < found.size(); ++i)
+        {
+            if (found[i].KeyframeOffset == 0 or found[i].FrameOffset == 0)
+            {
+                continue;
+            }
+            keyframes.push_back({(int32_t)(i * keyframeInterval), found[i]});
+        }
+        return true;
+    }
+
+    // If a record may begin at the offset read from the file.
+    [[nodiscard]] bool IsRecordOffset(uint64_t offset) const noexcept
+    {
+        return offset >= Format::HEADER_SIZE and offset < dataEnd;
+    }
+
+    // The size of the whole record at the offset.
+    optional<size_t> GetRecordSize(size_t offset) const noexcept
+    {
+        if (not IsRecordOffset(offset)) { return nullopt; }
+        const uint8_t *in = file.Data + offset;
+        size_t size;
+        if (in[0] == Format::FrameRecord)
+        {
+            if (dataEnd - offset < Format::FRAME_HEADER_SIZE)
+            {
+                return nullopt;
+            }
+            uint16_t beSize;
+            memcpy(&beSize, in + 5, 2);
+            size = Format::FRAME_HEADER_SIZE + ntohs(beSize);
+        }
+        else if (in[0] == Format::KeyframeRecord)
+        {
+            if (dataEnd - offset < Format::KEYFRAME_HEADER_SIZE)
+            {
+                return nullopt;
+            }
+            size = Format::KEYFRAME_HEADER_SIZE + LoadU32BE(in + 5);
+        }
+        else { return nullopt; }
+
+        if (size > dataEnd - offset) { return nullopt; }
+        return size;
+    }
+
+    bool LoadKeyframe(size_t offset) noexcept
+    {
+        optional<size_t> size = GetRecordSize(offset);
+        if (not size or file.Data[offset] != Format::KeyframeRecord)
+        {
+            return false;
+        }
+
+        const uint8_t *in = file.Data + offset + Format::KEYFRAME_HEADER_SIZE;
+        const size_t stateSize = *size - Format::KEYFRAME_HEADER_SIZE;
+        if constexpr (is_trivially_copyable_v<State>)
+        {
+            if (stateSize != sizeof(State)) { return false; }
+            memcpy(&state, in, sizeof(State));
+            return true;
+        }
+        else
+        {
+            return state.Deserialize(span{in, stateSize});
+        }
+    }
+
+    // Skip the keyframes between the frame records.
+    optional<span<const uint8_t>> FindFrame(int32_t frame) noexcept
+    {
+        while (cursor < dataEnd)
+        {
+            optional<size_t> size = GetRecordSize(cursor);
+            if (not size) { return nullopt; }
+
+            const uint8_t *in = file.Data + cursor;
+            const size_t offset = cursor;
+            cursor += *size;
+            if (in[0] != Format::FrameRecord) { continue; }
+            if ((int32_t)LoadU32BE(in + 1) != frame) { return nullopt; }
+            return span{file.Data + offset + Format::FRAME_HEADER_SIZE,
+                *size - Format::FRAME_HEADER_SIZE};
+        }
+        return nullopt;
+    }
+
+    // The dynamic parts of the inputs refer to the file.
+    bool DecodeFrame(span<const uint8_t> record) noexcept
+    {
+        size_t offset = 0;
+        for (Input &input : frameInputs)
+        {
+            if (record.size() - offset < Input::FIXED_SIZE) { return false; }
+            if constexpr (Input::FIXED_SIZE > 0)
+            {
+                memcpy(input.fixed.data(), &record[offset], Input::FIXED_SIZE);
+                offset += Input::FIXED_SIZE;
+            }
+            if constexpr (Input::DYNAMIC_SIZE)
+            {
+                if (record.size() - offset < 2) { return false; }
+                uint16_t beSize;
+                memcpy(&beSize, &record[offset], 2);
+                const size_t size = ntohs(beSize);
+                offset += 2;
+                if (record.size() - offset < size) { return false; }
+
+                // We only read it.
+                input.dyn = span{
+                    const_cast<uint8_t *>(record.data()) + offset, size};
+                offset += size;
+            }
+        }
+        return true;
+    }
+};
+
+} // namespace ks3::detail
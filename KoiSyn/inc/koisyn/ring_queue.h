@@ -0,0 +1,176 @@
+#pragma once
+
+#include "std/std_precomp.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// We don't use hardware_destructive_interference_size because it is not
+// available on every compiler we support and may vary between them.
+inline constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// The elements are preallocated, and the producer writes into the slot in
+// place, so there is no allocation after construction.
+template <typename T, size_t Capacity>
+    requires (has_single_bit(Capacity) and default_initializable<T>)
+class SpscRingQueue
+{
+private:
+    static constexpr size_t mask = Capacity - 1;
+
+    alignas(CACHE_LINE_SIZE) atomic_size_t head{}; // written by consumer
+    alignas(CACHE_LINE_SIZE) atomic_size_t tail{}; // written by producer
+    alignas(CACHE_LINE_SIZE) array<T, Capacity> slots{};
+
+public:
+    SpscRingQueue() noexcept = default;
+    SpscRingQueue(const SpscRingQueue &) = delete;
+    void operator=(const SpscRingQueue &) = delete;
+
+    static constexpr size_t GetCapacity() noexcept { return Capacity; }
+
+    // Call writer(T &) to fill a free slot. The writer may return false to
+    // cancel. Return false if the queue is full or cancelled.
+    template <typename Writer>
+    bool TryProduce(Writer &&writer) noexcept
+    {
+        const size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == Capacity) { return false; }
+
+        if (not writer(slots[t & mask])) { return false; }
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool TryPush(const T &value) noexcept
+    {
+        return TryProduce([&](T &slot) noexcept { slot = value; return true; });
+    }
+
+    // Call reader(T &) for every element in the queue at the moment, at most
+    // `limit` elements. The slot is reused after the reader returns.
+    // Return the number of elements read.
+    template <typename Reader>
+    size_t Drain(Reader &&reader, size_t limit = Capacity) noexcept
+    {
+        const size_t h = head.load(memory_order_relaxed);
+        const size_t t = tail.load(memory_order_acquire);
+        const size_t count = min(t - h, limit);
+        for (size_t i = 0; i < count; ++i)
+        {
+            reader(slots[(h + i) & mask]);
+        }
+        head.store(h + count, memory_order_release);
+        return count;
+    }
+};
+
+// Bounded lock-free queue for many producer threads and one consumer thread.
+// It is a variant of Dmitry Vyukov's bounded MPMC queue: every slot carries a
+// sequence number, so that a producer can claim a slot with one CAS and
+// publish it without blocking others. See:
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+template <typename T, size_t Capacity>
+    requires (has_single_bit(Capacity) and default_initializable<T>)
+class MpscRingQueue
+{
+private:
+    static constexpr size_t mask = Capacity - 1;
+
+    struct Cell
+    {
+        atomic_size_t Sequence;
+        T Value;
+    };
+
+    alignas(CACHE_LINE_SIZE) atomic_size_t enqueuePos{};
+    alignas(CACHE_LINE_SIZE) size_t dequeuePos{}; // consumer only
+    alignas(CACHE_LINE_SIZE) array<Cell, Capacity> cells;
+
+public:
+    MpscRingQueue() noexcept
+    {
+        for (size_t i = 0; i < Capacity; ++i)
+        {
+            cells[i].Sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    MpscRingQueue(const MpscRingQueue &) = delete;
+    void operator=(const MpscRingQueue &) = delete;
+
+    static constexpr size_t GetCapacity() noexcept { return Capacity; }
+
+    // Call writer(T &) to fill a claimed slot. Thread safe.
+    // Once a slot is claimed, it must be published, so a cancelling writer
+    // (returns false) leaves a slot that the consumer will skip.
+    // Return false if the queue is full or cancelled.
+    template <typename Writer>
+    bool TryProduce(Writer &&writer) noexcept
+    {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        Cell *cell;
+        while (true)
+        {
+            cell = &cells[pos & mask];
+            const size_t seq = cell->Sequence.load(memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                bool claimed = enqueuePos.compare_exchange_weak(
+                    pos, pos + 1, memory_order_relaxed);
+                if (claimed) { break; }
+            }
+            else if (diff < 0) { return false; } // full
+            else { pos = enqueuePos.load(memory_order_relaxed); }
+        }
+
+        const bool written = writer(cell->Value);
+
+        // Sequence == pos + 1: published and readable.
+        // Sequence == pos + 1 + Capacity would be the next round, so we use
+        // the highest bit to mark a cancelled slot.
+        constexpr size_t cancelled = ~(~size_t{} >> 1);
+        cell->Sequence.store(
+            (pos + 1) | (written ? 0 : cancelled), memory_order_release);
+        return written;
+    }
+
+    bool TryPush(const T &value) noexcept
+    {
+        return TryProduce([&](T &slot) noexcept { slot = value; return true; });
+    }
+
+    // Call reader(T &) for every published element in order, at most `limit`
+    // elements. Only one thread can call it at a time.
+    // Return the number of elements read.
+    template <typename Reader>
+    size_t Drain(Reader &&reader, size_t limit = Capacity) noexcept
+    {
+        constexpr size_t cancelled = ~(~size_t{} >> 1);
+        size_t count = 0;
+        while (count < limit)
+        {
+            Cell &cell = cells[dequeuePos & mask];
+            const size_t seq = cell.Sequence.load(memory_order_acquire);
+
+            // Not published yet. The later slots may be published, but we
+            // keep the order and read them next time.
+            if ((seq & ~cancelled) != dequeuePos + 1) { break; }
+
+            if ((seq & cancelled) == 0)
+            {
+                reader(cell.Value);
+                ++count;
+            }
+            cell.Sequence.store(dequeuePos + Capacity, memory_order_release);
+            ++dequeuePos;
+        }
+        return count;
+    }
+};
+
+} // namespace ks3::detail
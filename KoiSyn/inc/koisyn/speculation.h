@@ -0,0 +1,177 @@
+#pragma once
+
+#include "std/std_precomp.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// The most frequent whole inputs of a player, counted with the space-saving
+// algorithm in a tiny table. The engine simulates the top ones ahead of time
+// when the input of the player is unknown. Counts are halved when saturated
+// so that the table follows the player.
+template <int FixedSize, int TableSize = 4>
+    requires (FixedSize > 0 and TableSize > 0)
+struct InputCandidates
+{
+private:
+    static constexpr uint32_t saturation = 1024;
+
+    array<array<uint8_t, FixedSize>, TableSize> values{};
+    array<uint32_t, TableSize> counts{};
+
+public:
+    void Observe(const array<uint8_t, FixedSize> &in) noexcept
+    {
+        // Find the input, or replace the least frequent one.
+        int found = 0;
+        for (int i = 0; i < TableSize; ++i)
+        {
+            if (counts[i] != 0 and values[i] == in) { found = i; break; }
+            if (counts[i] < counts[found]) { found = i; }
+        }
+        values[found] = in;
+        if (++counts[found] >= saturation)
+        {
+            for (uint32_t &c : counts) { c >>= 1; }
+        }
+    }
+
+    // Write the most frequent inputs other than `exclude` to out, the most
+    // frequent first. Return the number written.
+    int GetTop(
+        const array<uint8_t, FixedSize> &exclude,
+        span<array<uint8_t, FixedSize>> out
+        ) const noexcept
+    {
+        array<bool, TableSize> taken{};
+        int written = 0;
+        while (written < (int)out.size())
+        {
+            int best = -1;
+            for (int i = 0; i < TableSize; ++i)
+            {
+                if (taken[i] or counts[i] == 0) { continue; }
+                if (values[i] == exclude) { continue; }
+                if (best == -1 or counts[i] > counts[best]) { best = i; }
+            }
+            if (best == -1) { break; }
+            taken[best] = true;
+            out[written++] = values[best];
+        }
+        return written;
+    }
+};
+
+// A fixed set of threads, each running at most one job at a time. The owner
+// starts jobs with Run() and must Wait() for all of them before touching
+// anything the jobs use. We don't allocate per job; a job is a function
+// pointer with its context.
+class WorkerPool
+{
+public:
+    using Job = void (*)(void *context) noexcept;
+
+private:
+    struct Worker
+    {
+        thread Thread;
+        binary_semaphore Start{0};
+        binary_semaphore Done{0};
+        Job Task = nullptr;
+        void *Context = nullptr;
+        bool Running = false; // owner only
+    };
+
+    unique_ptr<Worker[]> workers;
+    int numWorkers = 0;
+    atomic_bool stopping = false;
+
+public:
+    WorkerPool() noexcept = default;
+    WorkerPool(const WorkerPool &) = delete;
+    void operator=(const WorkerPool &) = delete;
+
+    ~WorkerPool() noexcept
+    {
+        Stop();
+    }
+
+    // Return false if the threads can't be created.
+    bool Start(int count) noexcept
+    try
+    {
+        Stop();
+        if (count <= 0) { return false; }
+        workers.reset(new(nothrow) Worker[count]);
+        if (not workers) [[unlikely]] { return false; }
+
+        stopping = false;
+        for (; numWorkers < count; ++numWorkers)
+        {
+            Worker &worker = workers[numWorkers];
+            worker.Thread = thread{&WorkerPool::Work, this, ref(worker)};
+        }
+        return true;
+    }
+    catch (...)
+    {
+        Stop();
+        return false;
+    }
+
+    void Stop() noexcept
+    {
+        Wait();
+        stopping = true;
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            workers[i].Start.release();
+            workers[i].Thread.join();
+        }
+        numWorkers = 0;
+        workers.reset();
+    }
+
+    [[nodiscard]] int GetNumWorkers() const noexcept { return numWorkers; }
+
+    // Start the job on the worker. Return false if it is still running.
+    bool Run(int i, Job job, void *context) noexcept
+    {
+        if (i < 0 or i >= numWorkers) [[unlikely]] { return false; }
+        Worker &worker = workers[i];
+        if (worker.Running) [[unlikely]] { return false; }
+
+        worker.Task = job;
+        worker.Context = context;
+        worker.Running = true;
+        worker.Start.release();
+        return true;
+    }
+
+    void Wait() noexcept
+    {
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            Worker &worker = workers[i];
+            if (not worker.Running) { continue; }
+            worker.Done.acquire();
+            worker.Running = false;
+        }
+    }
+
+private:
+    void Work(Worker &worker) noexcept
+    {
+        while (true)
+        {
+            worker.Start.acquire();
+            if (stopping) { return; }
+            worker.Task(worker.Context);
+            worker.Done.release();
+        }
+    }
+};
+
+} // namespace ks3::detail
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "std/std_precomp.h"
+#include "platform/koisyn_platform.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+using namespace std::chrono;
+
+// The first byte of every packet sent by the engine.
+enum class KoiSynPacket : uint8_t
+{
+    Input = 0,
+    Ping = 1,
+    Pong = 2,
+    Checksum = 3,
+    ChecksumDetail = 4,
+    Spectate = 5,
+};
+
+// Keep the frame counters of peers aligned.
+//
+// Every peer pings the others periodically with its local frame. The remote
+// answers with its own frame at the moment and how long the ping waited in
+// its queue, so that we can measure the round trip time without the waiting,
+// and estimate the frame that the remote is simulating right now:
+//
+//   remote frame now = remote frame in pong + (RTT / 2 + waiting) * FRAME_RATE
+//
+// Our frame advantage is our frame minus that. If we are ahead, the remote
+// predicts our inputs further and rolls back deeper, so we should give the
+// time back by stalling some frames or slowing down a little. The peer behind
+// sees a negative advantage and does nothing.
+//
+// Ping: [type] [player] [frame: 4, BE] [timestamp: 8, opaque]
+// Pong: [type] [player] [frame: 4, BE] [timestamp: 8, echoed] [hold us: 4, BE]
+template <int NumPlayers>
+class TimeSync
+{
+public:
+    static constexpr size_t PING_SIZE = 1 + 1 + 4 + 8;
+    static constexpr size_t PONG_SIZE = PING_SIZE + 4;
+
+    // We recommend a stall only when it is worth a whole frame, and never
+    // more than this at once, so the players don't notice it.
+    static constexpr int MAX_STALL_FRAMES = 2;
+
+    // Don't dilate more than this (5% of the frame duration).
+    static constexpr double MAX_DILATION = 0.05;
+
+private:
+    struct Peer
+    {
+        bool Valid = false;
+        double Advantage = 0; // smoothed, in frames
+        microseconds Rtt{};   // smoothed
+    };
+
+    array<Peer, NumPlayers> peers{};
+    int frameRate;
+
+public:
+    explicit TimeSync(int frameRate) noexcept : frameRate{frameRate} {}
+
+    [[nodiscard]] size_t EncodePing(
+        int localPlayer,
+        int32_t localFrame,
+        steady_clock::time_point now,
+        span<uint8_t> out
+        ) const noexcept
+    {
+        if (out.size() < PING_SIZE) [[unlikely]] { return 0; }
+        const uint64_t timestamp = now.time_since_epoch().count();
+        const uint32_t beFrame = htonl((uint32_t)localFrame);
+        out[0] = (uint8_t)KoiSynPacket::Ping;
+        out[1] = (uint8_t)localPlayer;
+        memcpy(&out[2], &beFrame, 4);
+        memcpy(&out[6], &timestamp, 8);
+        return PING_SIZE;
+    }
+
+    // Handle a ping or pong received at `receivedAt`. For a ping, write the
+    // pong to `reply` and return its size; otherwise return 0.
+    [[nodiscard]] size_t OnPacket(
+        span<const uint8_t> packet,
+        steady_clock::time_point receivedAt,
+        steady_clock::time_point now,
+        int localPlayer,
+        int32_t localFrame,
+        span<uint8_t> reply
+        ) noexcept
+    {
+        if (packet.size() < PING_SIZE) [[unlikely]] { return 0; }
+        const int player = packet[1];
+        if (player >= NumPlayers) [[unlikely]] { return 0; }
+
+        uint32_t beFrame;
+        memcpy(&beFrame, &packet[2], 4);
+        const int32_t remoteFrame = (int32_t)ntohl(beFrame);
+
+        if (packet[0] == (uint8_t)KoiSynPacket::Ping)
+        {
+            if (reply.size() < PONG_SIZE) [[unlikely]] { return 0; }
+            const auto held = duration_cast<microseconds>(now - receivedAt);
+            const int64_t heldUs = max<int64_t>(held.count(), 0);
+            const uint32_t beHeld = htonl((uint32_t)heldUs);
+            const uint32_t beLocalFrame = htonl((uint32_t)localFrame);
+            reply[0] = (uint8_t)KoiSynPacket::Pong;
+            reply[1] = (uint8_t)localPlayer;
+            memcpy(&reply[2], &beLocalFrame, 4);
+            memcpy(&reply[6], &packet[6], 8);
+            memcpy(&reply[14], &beHeld, 4);
+            return PONG_SIZE;
+        }
+
+        if (packet[0] == (uint8_t)KoiSynPacket::Pong)
+        {
+            if (packet.size() < PONG_SIZE) [[unlikely]] { return 0; }
+            uint64_t timestamp;
+            uint32_t beHeld;
+            memcpy(&timestamp, &packet[6], 8);
+            memcpy(&beHeld, &packet[14], 4);
+
+            const steady_clock::time_point sentAt{
+                steady_clock::duration{timestamp}};
+            const auto held = microseconds{ntohl(beHeld)};
+            auto rtt = duration_cast<microseconds>(receivedAt - sentAt) - held;
+            rtt = max(rtt, microseconds{0});
+
+            // The remote have simulated more frames during the half trip, and
+            // while the pong waited in our queue.
+            const auto waiting = duration_cast<microseconds>(now - receivedAt);
+            const double elapsed = (rtt.count() / 2.0 + waiting.count()) / 1e6;
+            const double remoteNow = remoteFrame + elapsed * frameRate;
+            const double advantage = localFrame - remoteNow;
+
+            Peer &peer = peers[player];
+            if (not peer.Valid)
+            {
+                peer.Valid = true;
+                peer.Advantage = advantage;
+                peer.Rtt = rtt;
+            }
+            else
+            {
+                // exponential moving average, alpha = 1/8
+                peer.Advantage += (advantage - peer.Advantage) / 8;
+                peer.Rtt += (rtt - peer.Rtt) / 8;
+            }
+        }
+        return 0;
+    }
+
+    void Reset(int player) noexcept
+    {
+        peers[player] = {};
+    }
+
+    [[nodiscard]] optional<microseconds> GetRtt(int player) const noexcept
+    {
+        if (not peers[player].Valid) { return nullopt; }
+        return peers[player].Rtt;
+    }
+
+    // How many frames we are ahead of the slowest peer. Negative if we are
+    // behind all of them.
+    [[nodiscard]] double GetFrameAdvantage() const noexcept
+    {
+        optional<double> worst;
+        for (const Peer &peer : peers)
+        {
+            if (not peer.Valid) { continue; }
+            worst = max(worst.value_or(peer.Advantage), peer.Advantage);
+        }
+        return worst.value_or(0);
+    }
+
+    // The frames we should skip simulating now. We assume the app follows
+    // it, so we take it off from our estimated advantage.
+    [[nodiscard]] int TakeRecommendedStall() noexcept
+    {
+        const double advantage = GetFrameAdvantage();
+        if (advantage < 1) { return 0; }
+
+        const int frames = min((int)advantage, MAX_STALL_FRAMES);
+        for (Peer &peer : peers)
+        {
+            if (peer.Valid) { peer.Advantage -= frames; }
+        }
+        return frames;
+    }
+
+    // The multiplier of the frame duration, for the app that prefers to slow
+    // down smoothly rather than stall. 1 means on time, and 1.02 means the
+    // frame should take 2% longer. Like stalls, only the peer ahead slows
+    // down. We ignore the advantage within half a frame to avoid
+    // oscillation.
+    [[nodiscard]] double GetRecommendedTimeScale() const noexcept
+    {
+        const double advantage = GetFrameAdvantage();
+        if (advantage < 0.5) { return 1; }
+        return 1 + min(advantage * 0.02, MAX_DILATION);
+    }
+};
+
+} // namespace ks3::detail
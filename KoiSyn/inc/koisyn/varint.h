@@ -0,0 +1,59 @@
+#pragma once
+
+#include "std/std_precomp.h"
+
+namespace ks3::detail
+{
+
+using namespace std;
+
+// Unsigned LEB128: 7 bits per byte, the least significant group first, and
+// the high bit set on every byte but the last. Small numbers, which are the
+// common case on wire, take one byte.
+inline constexpr size_t MAX_VARINT_SIZE = 10;
+
+[[nodiscard]] constexpr size_t GetVarintSize(uint64_t value) noexcept
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+// Return the size written, or 0 if out is too small.
+[[nodiscard]] inline size_t EncodeVarint(uint64_t value, span<uint8_t> out)
+    noexcept
+{
+    size_t size = 0;
+    while (true)
+    {
+        if (size == out.size()) [[unlikely]] { return 0; }
+        if (value < 0x80)
+        {
+            out[size++] = (uint8_t)value;
+            return size;
+        }
+        out[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+}
+
+// Return the size read, or 0 if the input ends before the varint does, or
+// it is too long to be valid.
+[[nodiscard]] inline size_t DecodeVarint(span<const uint8_t> in,
+    uint64_t &value) noexcept
+{
+    value = 0;
+    const size_t limit = min(in.size(), MAX_VARINT_SIZE);
+    for (size_t i = 0; i < limit; ++i)
+    {
+        value |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0) { return i + 1; }
+    }
+    return 0;
+}
+
+} // namespace ks3::detail
@@ -6,8 +6,10 @@ module;
 #include "inc/koisyn/checksum.h"
 #include "inc/koisyn/rpng.h"
 #include "inc/koisyn/udpsocket.h"
+#include "inc/koisyn/ring_queue.h"
 #include "inc/koisyn/koisession.h"
 #include "inc/koisyn/koisyn.h"
+#include "inc/koisyn/replay.h"
 
 export module KoiSyn;
 
@@ -34,16 +36,86 @@ export namespace ks3
     using detail::UdpSocket;
     using detail::UdpHandler;
 
+    // ring_queue.h
+    using detail::SpscRingQueue;
+    using detail::MpscRingQueue;
+
+    // buffer_pool.h
+    using detail::BufferPoolStats;
+    using detail::BufferPool;
+    using detail::GetSendBufferPool;
+
+    // predictor.h
+    using detail::ConceptInputPredictor;
+    using detail::RepeatLastPredictor;
+    using detail::NeutralPredictor;
+    using detail::FrequencyPredictor;
+
+    // speculation.h
+    using detail::InputCandidates;
+    using detail::WorkerPool;
+
+    // varint.h
+    using detail::MAX_VARINT_SIZE;
+    using detail::GetVarintSize;
+    using detail::EncodeVarint;
+    using detail::DecodeVarint;
+
+    // time_sync.h
+    using detail::KoiSynPacket;
+    using detail::TimeSync;
+
+    // redundancy.h
+    using detail::RedundancyWindow;
+
     // koisyn.h
     using detail::ConceptGameState;
     using detail::InputData;
     using detail::InputFor;
+    using detail::InputPacket;
+    using detail::InputHeader;
+    using detail::InputCodec;
+    using detail::DesyncReport;
+    using detail::DesyncDetector;
+    using detail::KoiSynStats;
     using detail::KoiSynBase;
     using detail::KoiSyn;
 
+    // replay.h
+    using detail::ConceptReplayableState;
+    using detail::ReplayWriter;
+    using detail::ReplayReader;
+
+    // path_policy.h
+    using detail::DuplicateMode;
+    using detail::PathPolicy;
+
+    // fec.h
+    using detail::ADAPTIVE_FEC;
+    using detail::ParityEncoder;
+    using detail::ParityDecoder;
+
+    // fragment.h
+    using detail::FragmentHeader;
+    using detail::FragmentAssembler;
+
+    // packet_window.h
+    using detail::PacketWindow;
+
+    // framing.h
+    using detail::FrameParser;
+
     // koichan.h
     using detail::Kontext;
     using detail::KoiChan;
+    using detail::SendCompletion;
+    using detail::StreamProgress;
+    using detail::SendResult;
+    using detail::ReceivedMessage;
+    using detail::DeferredReceiveCallback;
+    using detail::LOW_STREAM_PRIORITY;
+    using detail::DEFAULT_STREAM_PRIORITY;
+    using detail::HIGH_STREAM_PRIORITY;
 
     // koisession.h
     using detail::KoiSession;